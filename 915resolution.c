@@ -17,22 +17,42 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/io.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
 #include <assert.h>
 
-#define NEW(a) ((a *)(calloc(1, sizeof(a))))
-#define FREE(a) (free(a))
 
 #define VBIOS_START         0xc0000
 #define VBIOS_SIZE          0x10000
 
 #define VBIOS_FILE    "/dev/mem"
 
+#define LOCK_DIR      "/run/915resolution"
+#define QUEUE_PREFIX  "plan."
+#define QUEUE_BATCH   64
+
+#define PCI_CONFIG_FILE     "/sys/bus/pci/devices/0000:00:00.0/config"
+#define PCI_CONFIG_ADDRESS  0xcf8
+#define PCI_CONFIG_DATA     0xcfc
+
 #define FALSE 0
 #define TRUE 1
 
 #define MODE_TABLE_OFFSET_845G 617
 
+#define EDID_SIZE               128
+#define EDID_DETAILED_TIMING    54
+
+#define PATCH_MAGIC         "915P"
+#define PATCH_VERSION       4
+#define PATCH_MAX_RECORDS   1024
+#define PATCH_MERGE_GAP     (sizeof(patch_record))
+
 #define VERSION "0.5.3"
 
 #define ATI_SIGNATURE1 "ATI MOBILITY RADEON"
@@ -62,7 +82,24 @@ typedef enum {
 
 char * bios_type_names[] = {"UNKNOWN", "TYPE 1", "TYPE 2", "TYPE 3"};
 
-int freqs[] = { 60, 75, 85 };
+#define MODELINE_SLOTS 3
+
+#define MAX_MODE_BLOCKS 128
+#define SPLIT_MARGIN    16
+#define MAX_TARGETS     16
+
+/*
+ * make perf-check counts the bytes each stage reads from the image
+ */
+
+#ifdef PERF_CHECK
+unsigned long long bytes_scanned;
+#define SCANNED(n)      (bytes_scanned += (n))
+#else
+#define SCANNED(n)
+#endif
+
+int freqs[MODELINE_SLOTS] = { 60, 75, 85 };
 
 typedef struct {
     byte mode;
@@ -137,36 +174,462 @@ typedef struct {
 } __attribute__((packed)) vbios_resolution_type3;
 
 
+/*
+ * Timings in pixels and lines, the way a modeline is written.  The clock is
+ * in kHz.
+ */
+
+typedef struct {
+    unsigned long clock;
+
+    word x;
+    word hsyncstart;
+    word hsyncend;
+    word htotal;
+    word hblank;            /* end of blanking, 0 when it is htotal */
+
+    word y;
+    word vsyncstart;
+    word vsyncend;
+    word vtotal;
+    word vblank;            /* end of blanking, 0 when it is vtotal */
+} mode_timing;
+
+
+typedef struct {
+    cardinal x, y;
+} screen_size;
+
+
+/*
+ * A resolution block and how many mode table entries point at it
+ */
+
+typedef struct {
+    word resolution;
+    cardinal x, y;
+    cardinal modes;
+
+    boolean keep;
+    boolean rewrite;
+} mode_block;
+
+
+/*
+ * What scanning out a mode costs the memory shared with the CPU
+ */
+
+typedef struct {
+    cardinal refresh;       /* Hz */
+    cardinal framebuffer;   /* kB */
+    cardinal bandwidth;     /* MB/s */
+} mode_cost;
+
+
+typedef struct {
+    word offset;
+    word length;
+} __attribute__((packed)) patch_record;
+
+typedef struct {
+    char magic[4];
+    byte version;
+    byte bios;
+    word count;
+    cardinal target;        /* the bios a queued plan is for, 0 in plan files */
+    cardinal rom_size;      /* bytes covered by the hashes */
+    cardinal image_hash;
+    cardinal patched_hash;
+} __attribute__((packed)) patch_header;
+
+/*
+ * A patch plan is the byte-level difference between an image and its patched
+ * copy.  On disk it is the header, then the records, then the new bytes of
+ * every record back to back, then their original bytes the same way.
+ */
+
+typedef struct {
+    patch_header header;
+    patch_record records[PATCH_MAX_RECORDS];
+    cardinal data_size;
+    byte data[VBIOS_SIZE];
+    byte original[VBIOS_SIZE];
+} patch_plan;
+
+
 typedef struct {
     cardinal chipset_id;
     chipset_type chipset;
     bios_type bios;
     
     int bios_fd;
+    address image_ptr;
+
+    /* which bios this is, patchers only share queued plans for the same one */
+    cardinal target;
+
+    /*
+     * bios_ptr is what the mode table parser and set_mode work on.  It points
+     * at the mapped image until stage_vbios() redirects it to the private
+     * stage, where patches are built before being written in one go.
+     */
     address bios_ptr;
+    byte stage[VBIOS_SIZE];
+
+    /* the image as it was staged, other patchers may change it meanwhile */
+    byte snapshot[VBIOS_SIZE];
 
     vbios_mode * mode_table;
     cardinal mode_table_size;
 
-    byte b1, b2;
+    mode_block blocks[MAX_MODE_BLOCKS];
+    cardinal block_count;
 
+    byte pam[2];
+
+    boolean lockable;
     boolean unlocked;
 } vbios_map;
 
 
-void initialize_system(char * filename) {
+/*
+ * Everything needed to patch one image lives in this arena.  Nothing is
+ * allocated at run time, which keeps a static build free of malloc.
+ */
+
+typedef struct {
+    vbios_map map;
+    patch_plan plan;
+
+    patch_plan queued;
+    patch_plan batch;
+    byte merged[VBIOS_SIZE];
+} vbios_arena;
+
+static vbios_arena arena;
+
+
+/*
+ * All hardware access goes through a vbios_hal: the host bridge
+ * configuration space, and the mapping and writing of the video bios.
+ */
+
+typedef struct {
+    char * name;
+
+    /* whether a bios mapped from a -f file still sits behind PAM registers */
+    boolean lockable;
+
+    void (*config_read)(cardinal offset, byte * buf, cardinal len);
+    void (*config_write)(cardinal offset, const byte * buf, cardinal len);
+
+    void (*map_bios)(vbios_map * map, char * filename);
+    void (*unmap_bios)(vbios_map * map);
+    void (*write_bios)(vbios_map * map, cardinal offset, const byte * data, cardinal len);
+    cardinal (*target)(char * filename);
+
+    /* print what the backend saw, may be NULL */
+    void (*report)(vbios_map * map);
+} vbios_hal;
+
+
+cardinal pam_registers(vbios_map * map, cardinal * offset);
+
+
+/*
+ * The video bios, or a dump of it, is mapped from a file
+ */
+
+void mmap_bios(vbios_map * map, char * filename) {
+    map->bios_fd = open(filename ? filename : VBIOS_FILE, O_RDWR);
+    if(map->bios_fd < 0) {
+        if (map->chipset == CT_UNKWN) {
+            fprintf(stderr, "Invalid chipset detected: %x\n", map->chipset_id);
+        }
+        perror("Unable to open the BIOS file");
+        exit(2);
+    }
+    
+    map->image_ptr = mmap(0, VBIOS_SIZE,
+                          PROT_READ | PROT_WRITE, MAP_SHARED,
+                          map->bios_fd, filename ? 0 : VBIOS_START);
+    
+    if (map->image_ptr == MAP_FAILED) {
+        if (map->chipset == CT_UNKWN) {
+            fprintf(stderr, "Invalid chipset detected: %x\n", map->chipset_id);
+        }
+        perror(filename ? "Cannot mmap() the BIOS file\n" : "Cannot mmap() the video BIOS\n");
+        close(map->bios_fd);
+        exit(2);
+    }
+}
+
+void munmap_bios(vbios_map * map) {
+    munmap(map->image_ptr, VBIOS_SIZE);
+    close(map->bios_fd);
+}
+
+void memcpy_bios(vbios_map * map, cardinal offset, const byte * data, cardinal len) {
+    memcpy(map->image_ptr + offset, data, len);
+}
+
+/*
+ * Identify the bios by the device and inode of the file it is mapped from
+ */
+
+cardinal file_target(char * filename) {
+    struct stat st;
+
+    if (stat(filename ? filename : VBIOS_FILE, &st) < 0) {
+        perror("Unable to open the BIOS file");
+        exit(2);
+    }
+
+    return (cardinal) st.st_dev * 0x01000193 ^ (cardinal) st.st_ino;
+}
+
+
+/*
+ * Legacy configuration mechanism #1 through the 0xcf8/0xcfc ports
+ */
+
+void port_config_read(cardinal offset, byte * buf, cardinal len) {
+    cardinal i;
+
+    for (i=0; i < len; i++) {
+        if (i == 0 || ((offset+i) & 3) == 0) {
+            outl(0x80000000 | ((offset+i) & ~3), PCI_CONFIG_ADDRESS);
+        }
+        buf[i] = inb(PCI_CONFIG_DATA + ((offset+i) & 3));
+    }
+}
+
+void port_config_write(cardinal offset, const byte * buf, cardinal len) {
+    cardinal i;
+
+    for (i=0; i < len; i++) {
+        if (i == 0 || ((offset+i) & 3) == 0) {
+            outl(0x80000000 | ((offset+i) & ~3), PCI_CONFIG_ADDRESS);
+        }
+        outb(buf[i], PCI_CONFIG_DATA + ((offset+i) & 3));
+    }
+}
+
+
+/*
+ * A configuration space file, normally the sysfs entry of the host bridge
+ */
+
+int pci_config_fd = -1;
+
+void file_config_read(cardinal offset, byte * buf, cardinal len) {
+    if (pread(pci_config_fd, buf, len, offset) != len) {
+        perror("Unable to read the PCI configuration space");
+        exit(2);
+    }
+}
+
+void file_config_write(cardinal offset, const byte * buf, cardinal len) {
+    if (pwrite(pci_config_fd, buf, len, offset) != len) {
+        perror("Unable to write the PCI configuration space");
+        exit(2);
+    }
+}
+
+
+/*
+ * An in-process chipset.  The bios is a buffer loaded from the -f image and
+ * a write only lands when the PAM register covering its 16k segment is
+ * write enabled, as on the real shadow RAM.  Every access is counted.
+ */
+
+#define SIM_CONFIG_SIZE     256
+#define SIM_SEGMENT_SIZE    0x4000
+#define SIM_CHIPSET_ID      0x25908086
+
+struct {
+    byte config[SIM_CONFIG_SIZE];
+    byte bios[VBIOS_SIZE];
+
+    cardinal config_reads, config_writes;
+    cardinal bios_writes, bios_dropped;
+} sim;
+
+void sim_init(char * config) {
+    int fd;
+
+    memset(&sim, 0, sizeof(sim));
+
+    if (config) {
+        fd = open(config, O_RDONLY);
+        if (fd < 0 || read(fd, sim.config, SIM_CONFIG_SIZE) < 4) {
+            perror("Unable to read the PCI configuration file");
+            exit(2);
+        }
+        close(fd);
+    }
+    else {
+        sim.config[0] = SIM_CHIPSET_ID & 0xff;
+        sim.config[1] = (SIM_CHIPSET_ID >> 8) & 0xff;
+        sim.config[2] = (SIM_CHIPSET_ID >> 16) & 0xff;
+        sim.config[3] = (SIM_CHIPSET_ID >> 24) & 0xff;
+
+        /* shadow enabled for reads only */
+        memset(sim.config + 0x90, 0x11, 7);
+    }
+}
+
+void sim_config_read(cardinal offset, byte * buf, cardinal len) {
+    assert(offset + len <= SIM_CONFIG_SIZE);
+
+    memcpy(buf, sim.config + offset, len);
+    sim.config_reads++;
+}
+
+void sim_config_write(cardinal offset, const byte * buf, cardinal len) {
+    assert(offset + len <= SIM_CONFIG_SIZE);
+
+    memcpy(sim.config + offset, buf, len);
+    sim.config_writes++;
+}
+
+void sim_map_bios(vbios_map * map, char * filename) {
+    int fd;
 
     if (!filename) {
-        if (iopl(3) < 0) {
+        fprintf(stderr, "The simulator needs a BIOS image, give one with -f.\n");
+        exit(2);
+    }
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || read(fd, sim.bios, VBIOS_SIZE) < 0) {
+        perror("Unable to read the BIOS file");
+        exit(2);
+    }
+    close(fd);
+
+    map->bios_fd = -1;
+    map->image_ptr = sim.bios;
+}
+
+void sim_unmap_bios(vbios_map * map) {
+}
+
+/*
+ * Every process simulates a chipset of its own, so no other patcher can
+ * apply a plan to it
+ */
+
+cardinal sim_target(char * filename) {
+    return getpid();
+}
+
+void sim_write_bios(vbios_map * map, cardinal offset, const byte * data, cardinal len) {
+    cardinal i, base, segment;
+    byte pam;
+
+    for (i=0; i < len; i++) {
+        segment = (offset+i) / SIM_SEGMENT_SIZE;
+
+        if (pam_registers(map, &base)) {
+            pam = sim.config[base + segment/2];
+            pam = (segment & 1) ? (pam >> 4) : (pam & 0x0f);
+        }
+        else {
+            pam = 0;
+        }
+
+        if (pam & 0x2) {
+            sim.bios[offset+i] = data[i];
+            sim.bios_writes++;
+        }
+        else {
+            sim.bios_dropped++;
+        }
+    }
+}
+
+void sim_report(vbios_map * map) {
+    cardinal base, len, i;
+
+    printf("Simulator: %u config reads, %u config writes, %u BIOS bytes written, %u dropped",
+           sim.config_reads, sim.config_writes, sim.bios_writes, sim.bios_dropped);
+
+    len = pam_registers(map, &base);
+    if (len) {
+        printf(", PAM");
+        for (i=0; i < len; i++) {
+            printf(" %02x", sim.config[base+i]);
+        }
+    }
+    printf("\n");
+}
+
+
+vbios_hal port_hal = {
+    "port I/O", FALSE,
+    port_config_read, port_config_write,
+    mmap_bios, munmap_bios, memcpy_bios, file_target,
+    NULL
+};
+
+vbios_hal file_hal = {
+    "config file", TRUE,
+    file_config_read, file_config_write,
+    mmap_bios, munmap_bios, memcpy_bios, file_target,
+    NULL
+};
+
+vbios_hal sim_hal = {
+    "simulator", TRUE,
+    sim_config_read, sim_config_write,
+    sim_map_bios, sim_unmap_bios, sim_write_bios, sim_target,
+    sim_report
+};
+
+vbios_hal * hal = &port_hal;
+
+
+void initialize_system(char * filename, char * config, boolean simulate) {
+
+    if (simulate) {
+        sim_init(config);
+        hal = &sim_hal;
+    }
+    else if (config) {
+        pci_config_fd = open(config, O_RDWR);
+        if (pci_config_fd < 0) {
+            perror("Unable to open the PCI configuration file");
+            exit(2);
+        }
+        hal = &file_hal;
+    }
+    else if (!filename) {
+        pci_config_fd = open(PCI_CONFIG_FILE, O_RDWR);
+        if (pci_config_fd >= 0) {
+            hal = &file_hal;
+        }
+        else if (iopl(3) < 0) {
             perror("Unable to obtain the proper IO permissions");
             exit(2);
         }
     }
 }
 
+void pci_config_read(cardinal offset, byte * buf, cardinal len) {
+    hal->config_read(offset, buf, len);
+}
+
+void pci_config_write(cardinal offset, const byte * buf, cardinal len) {
+    hal->config_write(offset, buf, len);
+}
+
 cardinal get_chipset_id(void) {
-    outl(0x80000000, 0xcf8);
-    return inl(0xcfc);
+    byte id[4];
+
+    pci_config_read(0, id, sizeof(id));
+
+    return id[0] | (id[1] << 8) | (id[2] << 16) | ((cardinal) id[3] << 24);
 }
 
 chipset_type get_chipset(cardinal id) {
@@ -249,6 +712,8 @@ boolean detect_bios_type(vbios_map * map, boolean modeline, int entry_size) {
     
     r1 = r2 = 32000;
 
+    SCANNED(map->mode_table_size * sizeof(vbios_mode));
+
     for (i=0; i < map->mode_table_size; i++) {
         if (map->mode_table[i].resolution <= r1) {
             r1 = map->mode_table[i].resolution;
@@ -270,16 +735,26 @@ boolean detect_bios_type(vbios_map * map, boolean modeline, int entry_size) {
 
 
 void close_vbios(vbios_map * map);
+void index_modes(vbios_map * map);
 
 
-vbios_map * open_vbios(char * filename, chipset_type forced_chipset) {
-    vbios_map * map = NEW(vbios_map);
+/*
+ * Map the video bios and make sure it belongs to a chipset we know how to
+ * unlock.  The mode table is not looked at.
+ */
+
+vbios_map * map_vbios(char * filename, chipset_type forced_chipset) {
+    vbios_map * map = &arena.map;
+
+    memset(map, 0, sizeof(vbios_map));
 
     /*
      * Determine chipset
      */
 
-    if (!filename && forced_chipset == CT_UNKWN) {
+    map->lockable = !filename || hal->lockable;
+
+    if (map->lockable && forced_chipset == CT_UNKWN) {
         map->chipset_id = get_chipset_id();
 
         map->chipset = get_chipset(map->chipset_id);
@@ -295,52 +770,13 @@ vbios_map * open_vbios(char * filename, chipset_type forced_chipset) {
      *  Map the video bios to memory
      */
 
-    if (!filename) {
-        map->bios_fd = open(VBIOS_FILE, O_RDWR);
-        if(map->bios_fd < 0) {
-            if (map->chipset == CT_UNKWN) {
-                fprintf(stderr, "Invalid chipset detected: %x\n", map->chipset_id);
-            }
-            perror("Unable to open the BIOS file");
-            exit(2);
-        }
-        
-        map->bios_ptr = mmap(0, VBIOS_SIZE,
-                             PROT_READ | PROT_WRITE, MAP_SHARED,
-                             map->bios_fd, VBIOS_START);
-        
-        if (map->bios_ptr == MAP_FAILED) {
-            if (map->chipset == CT_UNKWN) {
-                fprintf(stderr, "Invalid chipset detected: %x\n", map->chipset_id);
-            }
-            perror("Cannot mmap() the video BIOS\n");
-            close(map->bios_fd);
-            exit(2);
-        }
-    }
-    else {
-        map->bios_fd = open(filename, O_RDWR);
-        if(map->bios_fd < 0) {
-            if (map->chipset == CT_UNKWN) {
-                fprintf(stderr, "Invalid chipset detected: %x\n", map->chipset_id);
-            }
-            perror("Unable to open the BIOS file");
-            exit(2);
-        }
-        
-        map->bios_ptr = mmap(0, VBIOS_SIZE,
-                             PROT_READ | PROT_WRITE, MAP_SHARED,
-                             map->bios_fd, 0);
-        
-        if (map->bios_ptr == MAP_FAILED) {
-            if (map->chipset == CT_UNKWN) {
-                fprintf(stderr, "Invalid chipset detected: %x\n", map->chipset_id);
-            }
-            perror("Cannot mmap() the BIOS file\n");
-            close(map->bios_fd);
-            exit(2);
-        }
-    }
+    hal->map_bios(map, filename);
+
+    map->bios_ptr = map->image_ptr;
+    map->target = hal->target(filename);
+
+    /* the signature scans below */
+    SCANNED((map->chipset == CT_UNKWN ? 4 : 3) * VBIOS_SIZE);
 
     /*
      * check if we have ATI Radeon
@@ -391,6 +827,10 @@ vbios_map * open_vbios(char * filename, chipset_type forced_chipset) {
         exit(2);
     }
 
+    return map;
+}
+
+void locate_mode_table(vbios_map * map) {
     /*
      * Figure out where the mode table is 
      */
@@ -411,6 +851,8 @@ vbios_map * open_vbios(char * filename, chipset_type forced_chipset) {
             p++;
         }
 
+        SCANNED(p - (map->bios_ptr + 16));
+
         if (map->mode_table == 0) {
             fprintf(stderr, "Unable to locate the mode table.\n");
             fprintf(stderr, "Please run the program 'dump_bios' as root and\n");
@@ -433,8 +875,12 @@ vbios_map * open_vbios(char * filename, chipset_type forced_chipset) {
             map->mode_table_size++;
             mode_ptr++;
         }
+
+        SCANNED((map->mode_table_size + 1) * sizeof(vbios_mode));
     }
+}
 
+void detect_bios(vbios_map * map) {
     /*
      * Figure out what type of bios we have
      *  order of detection is important
@@ -459,6 +905,19 @@ vbios_map * open_vbios(char * filename, chipset_type forced_chipset) {
         fprintf(stderr, "Mode Table Entries: %u\n", map->mode_table_size);
         exit(2);
     }
+}
+
+vbios_map * open_vbios(char * filename, chipset_type forced_chipset) {
+    vbios_map * map = map_vbios(filename, forced_chipset);
+
+    locate_mode_table(map);
+    detect_bios(map);
+
+    /*
+     * Find out which modes share their resolution
+     */
+
+    index_modes(map);
 
     return map;
 }
@@ -466,34 +925,26 @@ vbios_map * open_vbios(char * filename, chipset_type forced_chipset) {
 void close_vbios(vbios_map * map) {
     assert(!map->unlocked);
 
-    if(map->bios_ptr == MAP_FAILED) {
+    if(map->image_ptr == MAP_FAILED) {
         fprintf(stderr, "BIOS should be open already!\n");
         exit(2);
     }
 
-    munmap(map->bios_ptr, VBIOS_SIZE);
-    close(map->bios_fd);
-
-    FREE(map);
+    hal->unmap_bios(map);
 }
 
-void unlock_vbios(vbios_map * map) {
+/*
+ * Find the PAM registers that make the video bios shadow writable
+ */
 
-    assert(!map->unlocked);
-        
-    map->unlocked = TRUE;
-    
+cardinal pam_registers(vbios_map * map, cardinal * offset) {
     switch (map->chipset) {
     case CT_UNKWN:
         break;
     case CT_830:
     case CT_855GM:
-        outl(0x8000005a, 0xcf8);
-        map->b1 = inb(0xcfe);
-        
-        outl(0x8000005a, 0xcf8);
-        outb(0x33, 0xcfe);
-        break;
+        *offset = 0x5a;
+        return 1;
     case CT_845G:
     case CT_865G:
     case CT_915G:
@@ -503,235 +954,1353 @@ void unlock_vbios(vbios_map * map) {
     case CT_946GZ:
     case CT_G965:
     case CT_Q965:
-        outl(0x80000090, 0xcf8);
-        map->b1 = inb(0xcfd);
-        map->b2 = inb(0xcfe);
-        
-        outl(0x80000090, 0xcf8);
-        outb(0x33, 0xcfd);
-        outb(0x33, 0xcfe);
-        break;
+        *offset = 0x91;
+        return 2;
     }
 
-#if DEBUG
-    {
-        cardinal t = inl(0xcfc);
-        printf("unlock PAM: (0x%08x)\n", t);
-    }
+    return 0;
+}
+
+void unlock_vbios(vbios_map * map) {
+    static const byte writable[] = { 0x33, 0x33 };
+    cardinal offset, len;
+
+    assert(!map->unlocked);
+        
+    map->unlocked = TRUE;
+    
+    len = pam_registers(map, &offset);
+
+    if (len) {
+        pci_config_read(offset, map->pam, len);
+        pci_config_write(offset, writable, len);
+    }
+
+#if DEBUG
+    {
+        byte t[4];
+        pci_config_read(offset & ~3, t, sizeof(t));
+        printf("unlock PAM: (0x%02x%02x%02x%02x)\n", t[3], t[2], t[1], t[0]);
+    }
 #endif
 }
 
 void relock_vbios(vbios_map * map) {
+    cardinal offset, len;
 
     assert(map->unlocked);
     map->unlocked = FALSE;
     
-    switch (map->chipset) {
-    case CT_UNKWN:
+    len = pam_registers(map, &offset);
+
+    if (len) {
+        pci_config_write(offset, map->pam, len);
+    }
+
+#if DEBUG
+    {
+        byte t[4];
+        pci_config_read(offset & ~3, t, sizeof(t));
+        printf("relock PAM: (0x%02x%02x%02x%02x)\n", t[3], t[2], t[1], t[0]);
+    }
+#endif
+}
+
+
+/*
+ * The length the option ROM header gives.  The rest of the 64k window holds
+ * other option ROMs and upper memory, which may differ from boot to boot.
+ */
+
+boolean has_rom_header(address ptr) {
+    return ptr[0] == 0x55 && ptr[1] == 0xaa && ptr[2] != 0 && ptr[2] * 512 <= VBIOS_SIZE;
+}
+
+cardinal rom_size(address ptr) {
+    if (has_rom_header(ptr)) {
+        return ptr[2] * 512;
+    }
+
+    return VBIOS_SIZE;
+}
+
+cardinal hash_image(address ptr, cardinal size) {
+    cardinal hash = 0x811c9dc5;
+    cardinal i;
+
+    SCANNED(size);
+
+    /* FNV-1a */
+    for (i=0; i < size; i++) {
+        hash ^= ptr[i];
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+void stage_vbios(vbios_map * map) {
+    assert(map->bios_ptr == map->image_ptr);
+
+    memcpy(map->snapshot, map->image_ptr, VBIOS_SIZE);
+    memcpy(map->stage, map->snapshot, VBIOS_SIZE);
+    SCANNED(2 * VBIOS_SIZE);
+
+    map->mode_table = (vbios_mode *) (map->stage + ((address) map->mode_table - map->image_ptr));
+    map->bios_ptr = map->stage;
+}
+
+void diff_image(address image, address patched, patch_plan * plan);
+
+/*
+ * Turn the differences between the staged image and the stage into a patch
+ * plan.
+ */
+
+void build_patch(vbios_map * map, patch_plan * plan) {
+    patch_header * header = &plan->header;
+
+    memcpy(header->magic, PATCH_MAGIC, sizeof(header->magic));
+    header->version = PATCH_VERSION;
+    header->bios = map->bios;
+    header->count = 0;
+    header->target = 0;
+    header->rom_size = rom_size(map->snapshot);
+    header->image_hash = hash_image(map->snapshot, header->rom_size);
+    header->patched_hash = hash_image(map->bios_ptr, header->rom_size);
+
+    diff_image(map->snapshot, map->bios_ptr, plan);
+}
+
+/*
+ * Fill the records and data of a plan with the differences between two
+ * images.
+ * Runs separated by fewer bytes than a record header are merged.
+ */
+
+void diff_image(address image, address patched, patch_plan * plan) {
+    patch_header * header = &plan->header;
+    cardinal i, j, end;
+
+    header->count = 0;
+    plan->data_size = 0;
+
+    SCANNED(2 * VBIOS_SIZE);
+
+    i = 0;
+    while (i < VBIOS_SIZE) {
+        if (image[i] == patched[i]) {
+            i++;
+            continue;
+        }
+
+        end = i + 1;
+        for (j = end; j < VBIOS_SIZE && j < end + PATCH_MERGE_GAP && j < i + 0xffff; j++) {
+            if (image[j] != patched[j]) {
+                end = j + 1;
+            }
+        }
+
+        if (header->count == PATCH_MAX_RECORDS) {
+            fprintf(stderr, "The patch is too large: more than %d records.\n", PATCH_MAX_RECORDS);
+            exit(2);
+        }
+
+        plan->records[header->count].offset = i;
+        plan->records[header->count].length = end - i;
+        header->count++;
+
+        memcpy(plan->data + plan->data_size, patched + i, end - i);
+        memcpy(plan->original + plan->data_size, image + i, end - i);
+        plan->data_size += end - i;
+
+        i = end;
+    }
+}
+
+/*
+ * Copy the new bytes of a plan into the image.  The caller is responsible
+ * for unlocking the bios around this.
+ */
+
+void apply_patch(vbios_map * map, patch_plan * plan) {
+    address data = plan->data;
+    cardinal i;
+
+    for (i=0; i < plan->header.count; i++) {
+        hal->write_bios(map, plan->records[i].offset, data, plan->records[i].length);
+        data += plan->records[i].length;
+    }
+}
+
+/*
+ * Check that the new bytes of a plan really are in the image, to catch a
+ * bios that stayed write protected.
+ */
+
+void verify_patch(vbios_map * map, patch_plan * plan) {
+    address data = plan->data;
+    cardinal i;
+
+    SCANNED(plan->data_size);
+
+    for (i=0; i < plan->header.count; i++) {
+        if (memcmp(map->image_ptr + plan->records[i].offset, data, plan->records[i].length)) {
+            fprintf(stderr, "The BIOS did not take the patch at $C0000 + $%x, it is still write protected.\n",
+                    plan->records[i].offset);
+            exit(2);
+        }
+        data += plan->records[i].length;
+    }
+}
+
+void write_patch(patch_plan * plan, char * filename) {
+    cardinal records = plan->header.count * sizeof(patch_record);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        perror("Unable to create the patch file");
+        exit(2);
+    }
+
+    if (write(fd, &plan->header, sizeof(patch_header)) != sizeof(patch_header) ||
+        write(fd, plan->records, records) != records ||
+        write(fd, plan->data, plan->data_size) != plan->data_size ||
+        write(fd, plan->original, plan->data_size) != plan->data_size ||
+        close(fd) != 0) {
+        perror("Unable to write the patch file");
+        exit(2);
+    }
+}
+
+void read_patch(patch_plan * plan, char * filename) {
+    int fd = open(filename, O_RDONLY);
+    cardinal i;
+
+    if (fd < 0) {
+        perror("Unable to open the patch file");
+        exit(2);
+    }
+
+    if (read(fd, &plan->header, sizeof(patch_header)) != sizeof(patch_header) ||
+        memcmp(plan->header.magic, PATCH_MAGIC, sizeof(plan->header.magic)) ||
+        plan->header.version != PATCH_VERSION ||
+        plan->header.count > PATCH_MAX_RECORDS ||
+        plan->header.rom_size > VBIOS_SIZE ||
+        read(fd, plan->records, plan->header.count * sizeof(patch_record)) != plan->header.count * sizeof(patch_record)) {
+        fprintf(stderr, "%s is not a valid patch file.\n", filename);
+        exit(2);
+    }
+
+    plan->data_size = 0;
+
+    for (i=0; i < plan->header.count; i++) {
+        if (plan->records[i].offset + plan->records[i].length > VBIOS_SIZE) {
+            fprintf(stderr, "%s is not a valid patch file.\n", filename);
+            exit(2);
+        }
+        plan->data_size += plan->records[i].length;
+    }
+
+    if (plan->data_size > VBIOS_SIZE ||
+        read(fd, plan->data, plan->data_size) != plan->data_size ||
+        read(fd, plan->original, plan->data_size) != plan->data_size) {
+        fprintf(stderr, "%s is not a valid patch file.\n", filename);
+        exit(2);
+    }
+
+    close(fd);
+}
+
+
+/*
+ * Add the changes of a plan to the merged image, which starts as a copy of
+ * the bios.  Only the bytes the plan changes count: each must still hold
+ * its original value or already hold the new one, so plans built before
+ * another patch landed still merge as long as they do not touch the same
+ * bytes.  Bytes a plan leaves as they are, like the gaps inside its
+ * records, are not taken, so they cannot undo another plan.  A plan that
+ * conflicts is not merged at all.
+ */
+
+boolean merge_patch(address merged, patch_plan * plan) {
+    address data, original;
+    cardinal i, j, offset;
+    int pass;
+
+    for (pass=0; pass < 2; pass++) {
+        data = plan->data;
+        original = plan->original;
+
+        for (i=0; i < plan->header.count; i++) {
+            offset = plan->records[i].offset;
+
+            for (j=0; j < plan->records[i].length; j++, data++, original++) {
+                if (*data == *original) {
+                    continue;
+                }
+
+                if (pass) {
+                    merged[offset+j] = *data;
+                }
+                else if (merged[offset+j] != *original && merged[offset+j] != *data) {
+                    return FALSE;
+                }
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * Whether every byte a plan changes already holds its new value
+ */
+
+boolean patch_applied(address image, patch_plan * plan) {
+    address data = plan->data;
+    cardinal i;
+
+    SCANNED(plan->data_size);
+
+    for (i=0; i < plan->header.count; i++) {
+        if (memcmp(image + plan->records[i].offset, data, plan->records[i].length)) {
+            return FALSE;
+        }
+        data += plan->records[i].length;
+    }
+
+    return TRUE;
+}
+
+/*
+ * The queue directory is listed with getdents64 into a buffer of our own,
+ * as opendir would allocate one with malloc.
+ */
+
+typedef struct {
+    unsigned long long ino;
+    long long off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+} __attribute__((packed)) queue_entry;
+
+typedef struct {
+    byte buf[4096];
+    int fd;
+    int len, pos;
+} queue_reader;
+
+void open_queue(queue_reader * reader, char * lockdir) {
+    reader->fd = open(lockdir, O_RDONLY | O_DIRECTORY);
+    if (reader->fd < 0) {
+        perror("Unable to read the patch queue");
+        exit(2);
+    }
+
+    reader->len = reader->pos = 0;
+}
+
+char * read_queue(queue_reader * reader) {
+    queue_entry * entry;
+
+    if (reader->pos >= reader->len) {
+        reader->len = syscall(SYS_getdents64, reader->fd, reader->buf, sizeof(reader->buf));
+        reader->pos = 0;
+
+        if (reader->len < 0) {
+            perror("Unable to read the patch queue");
+            exit(2);
+        }
+
+        if (reader->len == 0) {
+            return NULL;
+        }
+    }
+
+    entry = (queue_entry *) (reader->buf + reader->pos);
+    reader->pos += entry->reclen;
+
+    return entry->name;
+}
+
+/*
+ * Gather every queued plan for this bios into one batch and apply it in a
+ * single unlock window.  Plans left by processes that are gone are dropped.
+ * Plans changing bytes that another patch, queued or already applied, set
+ * to another value are not taken; they are left for their owner to report.
+ * Plans leave the queue once the batch is verified, so a failure leaves
+ * them to their owners.  Returns FALSE when our own plan was refused.
+ * Must be called with the lock held.
+ */
+
+boolean drain_queue(vbios_map * map, char * lockdir) {
+    patch_plan * queued = &arena.queued;
+    patch_plan * batch = &arena.batch;
+    char path[PATH_MAX];
+    queue_reader reader;
+    int batched[QUEUE_BATCH];
+    cardinal plans = 0, i;
+    boolean own = TRUE;
+    char * name;
+    int pid;
+
+    open_queue(&reader, lockdir);
+
+    memcpy(arena.merged, map->image_ptr, VBIOS_SIZE);
+
+    while ((name = read_queue(&reader))) {
+        if (strncmp(name, QUEUE_PREFIX, strlen(QUEUE_PREFIX))) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", lockdir, name);
+        pid = atoi(name + strlen(QUEUE_PREFIX));
+
+        if (pid != getpid() && kill(pid, 0) < 0 && errno == ESRCH) {
+            unlink(path);
+            continue;
+        }
+
+        read_patch(queued, path);
+
+        if (queued->header.target != map->target) {
+            continue;
+        }
+
+        if (patch_applied(map->image_ptr, queued)) {
+            unlink(path);
+            continue;
+        }
+
+        if (plans == QUEUE_BATCH) {
+            /* left for the next batch */
+            continue;
+        }
+
+        if (!merge_patch(arena.merged, queued)) {
+            if (pid == getpid()) {
+                unlink(path);
+                own = FALSE;
+            }
+            continue;
+        }
+
+        batched[plans++] = pid;
+    }
+
+    close(reader.fd);
+
+    diff_image(map->image_ptr, arena.merged, batch);
+
+    if (batch->header.count) {
+        unlock_vbios(map);
+        apply_patch(map, batch);
+        relock_vbios(map);
+        verify_patch(map, batch);
+    }
+
+    for (i=0; i < plans; i++) {
+        snprintf(path, sizeof(path), "%s/%s%d", lockdir, QUEUE_PREFIX, batched[i]);
+        unlink(path);
+    }
+
+    if (plans > 1) {
+        printf("Applied %u queued patches in one unlock window\n", plans);
+    }
+
+    return own;
+}
+
+/*
+ * Write a plan to the bios.  Several copies may run at once from boot and
+ * resume hooks, so the PAM registers are only touched while holding a lock
+ * in lockdir.  A patcher first queues its plan there; whoever gets the lock
+ * applies everything queued, so waiting patchers share one unlock window.
+ * Without a lockdir the plan is applied straight away.
+ */
+
+void commit_patch(vbios_map * map, patch_plan * plan, char * lockdir) {
+    char path[PATH_MAX], queued[PATH_MAX];
+    int fd;
+
+    if (!map->lockable) {
+        apply_patch(map, plan);
+        verify_patch(map, plan);
+        return;
+    }
+
+    if (!lockdir) {
+        unlock_vbios(map);
+        apply_patch(map, plan);
+        relock_vbios(map);
+        verify_patch(map, plan);
+        return;
+    }
+
+    if (mkdir(lockdir, 0755) < 0 && errno != EEXIST) {
+        perror("Unable to create the lock directory");
+        exit(2);
+    }
+
+    snprintf(path, sizeof(path), "%s/.%s%d", lockdir, QUEUE_PREFIX, getpid());
+    snprintf(queued, sizeof(queued), "%s/%s%d", lockdir, QUEUE_PREFIX, getpid());
+
+    plan->header.target = map->target;
+    write_patch(plan, path);
+
+    if (rename(path, queued) < 0) {
+        perror("Unable to queue the patch");
+        exit(2);
+    }
+
+    snprintf(path, sizeof(path), "%s/lock", lockdir);
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX) < 0) {
+        perror("Unable to lock the BIOS");
+        exit(2);
+    }
+
+    /*
+     * Our plan is gone when a patcher, maybe us, applied and verified it
+     */
+
+    while (access(queued, F_OK) == 0) {
+        if (!drain_queue(map, lockdir)) {
+            fprintf(stderr, "The patch conflicts with another one applied while it was waiting, it was not applied.\n");
+            exit(2);
+        }
+    }
+
+    close(fd);
+}
+
+
+void get_mode_resolution(vbios_map * map, vbios_mode * mode, cardinal * x, cardinal * y) {
+    switch(map->bios) {
+    case BT_1:
+        {
+            vbios_resolution_type1 * res = map_type1_resolution(map, mode->resolution);
+
+            *x = ((((cardinal) res->x2) & 0xf0) << 4) | res->x1;
+            *y = ((((cardinal) res->y2) & 0xf0) << 4) | res->y1;
+        }
         break;
-    case CT_830:
-    case CT_855GM:
-        outl(0x8000005a, 0xcf8);
-        outb(map->b1, 0xcfe);
+    case BT_2:
+        {
+            vbios_resolution_type2 * res = map_type2_resolution(map, mode->resolution);
+
+            *x = res->modelines[0].x1+1;
+            *y = res->modelines[0].y1+1;
+        }
         break;
-    case CT_845G:
-    case CT_865G:
-    case CT_915G:
-    case CT_915GM:
-    case CT_945G:
-    case CT_945GM:
-    case CT_946GZ:
-    case CT_G965:
-    case CT_Q965:
-        outl(0x80000090, 0xcf8);
-        outb(map->b1, 0xcfd);
-        outb(map->b2, 0xcfe);
+    case BT_3:
+        {
+            vbios_resolution_type3 * res = map_type3_resolution(map, mode->resolution);
+
+            *x = res->modelines[0].x1+1;
+            *y = res->modelines[0].y1+1;
+        }
         break;
+    case BT_UNKWN:
+        *x = *y = 0;
+        break;
+    }
+}
+
+/*
+ * Collect the distinct resolution blocks of the mode table
+ */
+
+void index_modes(vbios_map * map) {
+    cardinal i, j;
+
+    map->block_count = 0;
+
+    SCANNED(map->mode_table_size * sizeof(vbios_mode));
+
+    for (i=0; i < map->mode_table_size; i++) {
+        for (j=0; j < map->block_count; j++) {
+            if (map->blocks[j].resolution == map->mode_table[i].resolution) {
+                break;
+            }
+        }
+
+        if (j == map->block_count) {
+            if (j == MAX_MODE_BLOCKS) {
+                fprintf(stderr, "The mode table has more than %d resolution blocks.\n", MAX_MODE_BLOCKS);
+                exit(2);
+            }
+
+            memset(&map->blocks[j], 0, sizeof(mode_block));
+            map->blocks[j].resolution = map->mode_table[i].resolution;
+            get_mode_resolution(map, &map->mode_table[i], &map->blocks[j].x, &map->blocks[j].y);
+
+            map->block_count++;
+        }
+
+        map->blocks[j].modes++;
+    }
+}
+
+mode_block * find_block(vbios_map * map, word resolution) {
+    cardinal i;
+
+    for (i=0; i < map->block_count; i++) {
+        if (map->blocks[i].resolution == resolution) {
+            return &map->blocks[i];
+        }
+    }
+
+    return NULL;
+}
+
+void print_block_modes(vbios_map * map, mode_block * block) {
+    cardinal i;
+
+    for (i=0; i < map->mode_table_size; i++) {
+        if (map->mode_table[i].resolution == block->resolution) {
+            printf(" %02x", map->mode_table[i].mode);
+        }
+    }
+}
+
+/*
+ * Estimate the cost of one modeline slot of a mode.  Type 1 BIOSes carry no
+ * clock, their modes are taken to run at the lowest refresh rate.
+ */
+
+void estimate_mode(vbios_map * map, vbios_mode * mode, cardinal slot, mode_cost * cost) {
+    vbios_modeline_type2 * modeline = NULL;
+    cardinal x, y, bytes;
+
+    get_mode_resolution(map, mode, &x, &y);
+
+    switch(map->bios) {
+    case BT_2:
+        modeline = &map_type2_resolution(map, mode->resolution)->modelines[slot];
+        break;
+    case BT_3:
+        modeline = (vbios_modeline_type2 *) &map_type3_resolution(map, mode->resolution)->modelines[slot];
+        break;
+    case BT_1:
+    case BT_UNKWN:
+        break;
+    }
+
+    if (modeline && modeline->htotal && modeline->vtotal) {
+        cost->refresh = modeline->clock * 1000 / ((modeline->htotal+1) * (modeline->vtotal+1));
+    }
+    else {
+        cost->refresh = freqs[0];
+    }
+
+    bytes = x * y * ((mode->bits_per_pixel+7) / 8);
+
+    cost->framebuffer = bytes / 1024;
+    cost->bandwidth = bytes / 1000 * cost->refresh / 1000;
+}
+
+/*
+ * Keep every resolution block the patch wrote within the memory budgets.
+ * All the modes pointing at a block share its modelines, so the deepest of
+ * them decides.  Slots that need more bandwidth are replaced by the fastest
+ * slot that fits; when none fits, or when the framebuffer itself is too
+ * large, nothing is patched.
+ */
+
+void check_budget(vbios_map * map, cardinal bandwidth, cardinal framebuffer) {
+    cardinal b, i, j, k, slots;
+    mode_cost cost, best = { 0, 0, 0 };
+    vbios_mode * deepest;
+    mode_block * block;
+    int fit;
+
+    slots = (map->bios == BT_2 || map->bios == BT_3) ? MODELINE_SLOTS : 1;
+
+    for (b=0; b < map->block_count; b++) {
+        block = &map->blocks[b];
+
+        if (!block->rewrite) {
+            continue;
+        }
+
+        deepest = NULL;
+
+        for (i=0; i < map->mode_table_size; i++) {
+            if (map->mode_table[i].resolution == block->resolution &&
+                (!deepest || map->mode_table[i].bits_per_pixel > deepest->bits_per_pixel)) {
+                deepest = &map->mode_table[i];
+            }
+        }
+
+        for (j=0; j < slots; j++) {
+            estimate_mode(map, deepest, j, &cost);
+
+            printf("Mode %02x slot %d : %d Hz, framebuffer %u kB, scanout %u MB/s\n",
+                   deepest->mode, j, cost.refresh, cost.framebuffer, cost.bandwidth);
+
+            if (framebuffer && cost.framebuffer > framebuffer) {
+                fprintf(stderr, "Mode %02x needs a %u kB framebuffer, over the %u kB budget.\n",
+                        deepest->mode, cost.framebuffer, framebuffer);
+                exit(2);
+            }
+
+            if (!bandwidth || cost.bandwidth <= bandwidth) {
+                continue;
+            }
+
+            fit = -1;
+            best.refresh = 0;
+
+            for (k=0; k < slots; k++) {
+                estimate_mode(map, deepest, k, &cost);
+
+                if (cost.bandwidth <= bandwidth && cost.refresh > best.refresh) {
+                    fit = k;
+                    best = cost;
+                }
+            }
+
+            if (fit < 0) {
+                fprintf(stderr, "Mode %02x needs more than the %u MB/s scanout budget at every refresh rate.\n",
+                        deepest->mode, bandwidth);
+                exit(2);
+            }
+
+            printf("Mode %02x slot %d : over the %u MB/s budget, using slot %d (%d Hz, %u MB/s) instead\n",
+                   deepest->mode, j, bandwidth, fit, best.refresh, best.bandwidth);
+
+            if (map->bios == BT_2) {
+                vbios_resolution_type2 * res = map_type2_resolution(map, block->resolution);
+                res->modelines[j] = res->modelines[fit];
+            }
+            else {
+                vbios_resolution_type3 * res = map_type3_resolution(map, block->resolution);
+                res->modelines[j] = res->modelines[fit];
+            }
+        }
+    }
+}
+
+/*
+ * Type 3 modelines start with the same fields as type 2 ones, so both are
+ * printed through the type 2 layout.
+ */
+
+void print_modeline(cardinal mode, cardinal slot, vbios_modeline_type2 * modeline) {
+    printf("Mode %02x slot %d (raw) : %lu kHz, h %d %d %d %d %d, v %d %d %d %d %d\n", mode, slot,
+           modeline->clock,
+           modeline->x1, modeline->hsyncstart, modeline->hsyncend, modeline->hblank, modeline->htotal,
+           modeline->y1, modeline->vsyncstart, modeline->vsyncend, modeline->vblank, modeline->vtotal);
+}
+
+void list_modes(vbios_map *map, cardinal raw, cardinal estimate) {
+    cardinal i, j, x, y;
+    mode_cost cost;
+
+    SCANNED(map->mode_table_size * sizeof(vbios_mode));
+
+    for (i=0; i < map->mode_table_size; i++) {
+        get_mode_resolution(map, &map->mode_table[i], &x, &y);
+
+        if (x != 0 && y != 0 && estimate) {
+            estimate_mode(map, &map->mode_table[i], 0, &cost);
+
+            printf("Mode %02x : %dx%d, %d bits/pixel, framebuffer %u kB, scanout %u MB/s at %d Hz\n",
+                   map->mode_table[i].mode, x, y, map->mode_table[i].bits_per_pixel,
+                   cost.framebuffer, cost.bandwidth, cost.refresh);
+        }
+        else if (x != 0 && y != 0) {
+            printf("Mode %02x : %dx%d, %d bits/pixel\n", map->mode_table[i].mode, x, y, map->mode_table[i].bits_per_pixel);
+        }
+
+        if (!raw) {
+            continue;
+        }
+
+        switch(map->bios) {
+        case BT_1:
+            {
+                vbios_resolution_type1 * res = map_type1_resolution(map, map->mode_table[i].resolution);
+
+                printf("Mode %02x (raw) :\n\t%02x %02x\n\t%02x\n\t%02x\n\t%02x\n\t%02x\n\t%02x\n\t%02x\n", map->mode_table[i].mode, res->unknow1[0],res->unknow1[1], res->x1,res->x_total,res->x2,res->y1,res->y_total,res->y2);
+            }
+            break;
+        case BT_2:
+            {
+                vbios_resolution_type2 * res = map_type2_resolution(map, map->mode_table[i].resolution);
+
+                for (j=0; j < MODELINE_SLOTS; j++) {
+                    print_modeline(map->mode_table[i].mode, j, (vbios_modeline_type2 *) &res->modelines[j]);
+                }
+            }
+            break;
+        case BT_3:
+            {
+                vbios_resolution_type3 * res = map_type3_resolution(map, map->mode_table[i].resolution);
+
+                for (j=0; j < MODELINE_SLOTS; j++) {
+                    print_modeline(map->mode_table[i].mode, j, (vbios_modeline_type2 *) &res->modelines[j]);
+                }
+            }
+            break;
+        case BT_UNKWN:
+            break;
+        }
+    }
+
+    if (map->block_count < map->mode_table_size) {
+        printf("\nShared resolution blocks :\n");
+
+        for (i=0; i < map->block_count; i++) {
+            if (map->blocks[i].modes > 1) {
+                printf("$C0000 + $%x :", map->blocks[i].resolution);
+                print_block_modes(map, &map->blocks[i]);
+                printf("\n");
+            }
+        }
+    }
+}
+
+/*
+ * Read the preferred detailed timing of a binary EDID block
+ */
+
+void read_edid_timing(char * filename, mode_timing * timing) {
+    static const byte edid_header[] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+    byte edid[EDID_SIZE];
+    byte * dtd = edid + EDID_DETAILED_TIMING;
+    byte sum = 0;
+    cardinal i;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        perror("Unable to open the EDID file");
+        exit(2);
+    }
+
+    if (read(fd, edid, EDID_SIZE) != EDID_SIZE) {
+        fprintf(stderr, "%s is too short to be an EDID block.\n", filename);
+        exit(2);
+    }
+
+    close(fd);
+
+    for (i=0; i < EDID_SIZE; i++) {
+        sum += edid[i];
+    }
+
+    if (memcmp(edid, edid_header, sizeof(edid_header)) || sum != 0) {
+        fprintf(stderr, "%s is not a valid EDID block.\n", filename);
+        exit(2);
+    }
+
+    if (dtd[0] == 0 && dtd[1] == 0) {
+        fprintf(stderr, "%s has no preferred detailed timing.\n", filename);
+        exit(2);
+    }
+
+    timing->clock = (dtd[0] | (dtd[1] << 8)) * 10;
+
+    timing->x = dtd[2] | ((dtd[4] & 0xf0) << 4);
+    timing->htotal = timing->x + (dtd[3] | ((dtd[4] & 0x0f) << 8));
+    timing->hsyncstart = timing->x + (dtd[8] | ((dtd[11] & 0xc0) << 2));
+    timing->hsyncend = timing->hsyncstart + (dtd[9] | ((dtd[11] & 0x30) << 4));
+
+    timing->y = dtd[5] | ((dtd[7] & 0xf0) << 4);
+    timing->vtotal = timing->y + (dtd[6] | ((dtd[7] & 0x0f) << 8));
+    timing->vsyncstart = timing->y + ((dtd[10] >> 4) | ((dtd[11] & 0x0c) << 2));
+    timing->vsyncend = timing->vsyncstart + ((dtd[10] & 0x0f) | ((dtd[11] & 0x03) << 4));
+
+    /* blanking lasts until the end of the line and of the frame */
+    timing->hblank = 0;
+    timing->vblank = 0;
+}
+
+/*
+ * Choose the mode to sacrifice for a resolution: a mode that already has it,
+ * otherwise the largest one, which is the least likely to be used.
+ */
+
+boolean has_mode(vbios_map * map, cardinal mode) {
+    cardinal i;
+
+    for (i=0; i < map->mode_table_size; i++) {
+        if (map->mode_table[i].mode == mode) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+cardinal pick_mode(vbios_map * map, cardinal x, cardinal y, cardinal bp) {
+    cardinal i, mx, my, mode = 0, area = 0;
+
+    for (i=0; i < map->mode_table_size; i++) {
+        if (bp && map->mode_table[i].bits_per_pixel != bp) {
+            continue;
+        }
+
+        get_mode_resolution(map, &map->mode_table[i], &mx, &my);
+
+        if (mx == x && my == y) {
+            return map->mode_table[i].mode;
+        }
+
+        if (mx * my >= area) {
+            area = mx * my;
+            mode = map->mode_table[i].mode;
+        }
+    }
+
+    return mode;
+}
+
+static void gtf_timings(int x, int y, int freq,
+        unsigned long *clock,
+        word *hsyncstart, word *hsyncend, word *hblank,
+        word *vsyncstart, word *vsyncend, word *vblank)
+{
+    int hbl, vbl, vfreq;
+
+    vbl = y + (y+1)/(20000.0/(11*freq) - 1) + 1.5;
+    vfreq = vbl * freq;
+    hbl = 16 * (int)(x * (30.0 - 300000.0 / vfreq) /
+            (70.0 + 300000.0 / vfreq) / 16.0 + 0.5);
+
+    *vsyncstart = y;
+    *vsyncend = y + 3;
+    *vblank = vbl - 1;
+    *hsyncstart = x + hbl / 2 - (x + hbl + 50) / 100 * 8 - 1;
+    *hsyncend = x + hbl / 2 - 1;
+    *hblank = x + hbl - 1;
+    *clock = (x + hbl) * vfreq / 1000;
+}
+
+/*
+ * Program exact timings into a modeline.  The bios counts from zero, so
+ * every position is one less than in the timing.
+ */
+
+void set_timing_type2(vbios_modeline_type2 * modeline, mode_timing * timing) {
+    modeline->clock = timing->clock;
+
+    modeline->x1 = modeline->x2 = timing->x-1;
+    modeline->hsyncstart = timing->hsyncstart-1;
+    modeline->hsyncend = timing->hsyncend-1;
+    modeline->htotal = timing->htotal-1;
+    modeline->hblank = (timing->hblank ? timing->hblank : timing->htotal)-1;
+
+    modeline->y1 = modeline->y2 = timing->y-1;
+    modeline->vsyncstart = timing->vsyncstart-1;
+    modeline->vsyncend = timing->vsyncend-1;
+    modeline->vtotal = timing->vtotal-1;
+    modeline->vblank = (timing->vblank ? timing->vblank : timing->vtotal)-1;
+}
+
+void set_timing_type3(vbios_modeline_type3 * modeline, mode_timing * timing) {
+    modeline->clock = timing->clock;
+
+    modeline->x1 = modeline->x2 = timing->x-1;
+    modeline->hsyncstart = timing->hsyncstart-1;
+    modeline->hsyncend = timing->hsyncend-1;
+    modeline->htotal = timing->htotal-1;
+    modeline->hblank = (timing->hblank ? timing->hblank : timing->htotal)-1;
+
+    modeline->y1 = modeline->y2 = timing->y-1;
+    modeline->vsyncstart = timing->vsyncstart-1;
+    modeline->vsyncend = timing->vsyncend-1;
+    modeline->vtotal = timing->vtotal-1;
+    modeline->vblank = (timing->vblank ? timing->vblank : timing->vtotal)-1;
+
+    modeline->timing_h = timing->y-1;
+    modeline->timing_v = timing->x-1;
+}
+
+/*
+ * When timing is given it replaces the GTF timings (types 2 and 3) or
+ * supplies htotal/vtotal (type 1).
+ */
+
+cardinal block_size(vbios_map * map) {
+    switch(map->bios) {
+    case BT_1:
+        return sizeof(vbios_resolution_type1);
+    case BT_2:
+        return sizeof(vbios_resolution_type2) + MODELINE_SLOTS * sizeof(vbios_modeline_type2);
+    case BT_3:
+        return sizeof(vbios_resolution_type3) + MODELINE_SLOTS * sizeof(vbios_modeline_type3);
+    case BT_UNKWN:
+        break;
+    }
+
+    return 0;
+}
+
+/*
+ * Find room for a new block of size bytes, with some margin, in the padding
+ * at the end of the option rom.  Only the trailing padding is used: runs of
+ * 0x00 or 0xff further in may belong to the VBT or other tables, which the
+ * driver still reads from the shadow.  The room must also be above the mode
+ * table and every resolution block, which leaves bios type detection alone.
+ * Without a valid 0x55 0xaa header nothing is used, as the end of the 64k
+ * window may belong to another option rom or to upper memory.
+ */
+
+word find_free_space(vbios_map * map, cardinal size) {
+    address p = map->bios_ptr;
+    cardinal start, end, i;
+
+    start = (address) (map->mode_table + map->mode_table_size + 1) - p;
+
+    for (i=0; i < map->block_count; i++) {
+        if (map->blocks[i].resolution + block_size(map) > start) {
+            start = map->blocks[i].resolution + block_size(map);
+        }
+    }
+
+    /* without a header the end of the rom is unknown */
+    if (!has_rom_header(p)) {
+        return 0;
+    }
+
+    /* the last byte is the checksum */
+    end = rom_size(p) - 1;
+
+    if (end == 0 || (p[end-1] != 0x00 && p[end-1] != 0xff)) {
+        return 0;
+    }
+
+    for (i=end-1; i > start && p[i-1] == p[end-1]; i--)
+        ;
+
+    if (end - i < size + 2 * SPLIT_MARGIN) {
+        return 0;
+    }
+
+    return i + SPLIT_MARGIN;
+}
+
+/*
+ * Give a mode its own copy of a shared resolution block, so patching it
+ * leaves the other modes alone.
+ */
+
+void split_mode(vbios_map * map, cardinal mode) {
+    cardinal i, size = block_size(map);
+    mode_block * block;
+    word offset;
+
+    for (i=0; i < map->mode_table_size; i++) {
+        if (map->mode_table[i].mode != mode) {
+            continue;
+        }
+
+        block = find_block(map, map->mode_table[i].resolution);
+
+        if (block->modes < 2) {
+            continue;
+        }
+
+        offset = find_free_space(map, size);
+
+        if (!offset && !has_rom_header(map->bios_ptr)) {
+            fprintf(stderr, "The BIOS has no valid option ROM header, mode %02x cannot be given its own resolution block.\n", mode);
+            exit(2);
+        }
+
+        if (!offset) {
+            fprintf(stderr, "No free space in the BIOS to give mode %02x its own resolution block.\n", mode);
+            exit(2);
+        }
+
+        memcpy(map->bios_ptr + offset, map->bios_ptr + block->resolution, size);
+        map->mode_table[i].resolution = offset;
+
+        printf("Mode %02x moved to its own resolution block at $C0000 + $%x\n", mode, offset);
+
+        index_modes(map);
+    }
+}
+
+/*
+ * Write a resolution into one resolution block.  Every mode pointing at the
+ * block changes with it.
+ */
+
+void set_resolution(vbios_map * map, word resolution, cardinal x, cardinal y, cardinal htotal, cardinal vtotal, mode_timing * timing) {
+    int xprev, yprev;
+    cardinal j;
+
+    if (timing && map->bios == BT_1) {
+        htotal = timing->htotal;
+        vtotal = timing->vtotal;
+    }
+
+    switch(map->bios) {
+    case BT_1:
+        {
+            vbios_resolution_type1 * res = map_type1_resolution(map, resolution);
+            
+            res->x2 = (htotal?(((htotal-x) >> 8) & 0x0f) : (res->x2 & 0x0f)) | ((x >> 4) & 0xf0);
+            res->x1 = (x & 0xff);
+            
+            res->y2 = (vtotal?(((vtotal-y) >> 8) & 0x0f) : (res->y2 & 0x0f)) | ((y >> 4) & 0xf0);
+            res->y1 = (y & 0xff);
+            if (htotal)
+                res->x_total = ((htotal-x) & 0xff);
+
+            if (vtotal)
+                res->y_total = ((vtotal-y) & 0xff);
+        }
+        break;
+    case BT_2:
+        {
+            vbios_resolution_type2 * res = map_type2_resolution(map, resolution);
+
+            res->xchars = x / 8;
+            res->ychars = y / 16 - 1;
+            xprev = res->modelines[0].x1;
+            yprev = res->modelines[0].y1;
+
+            for(j=0; j < MODELINE_SLOTS; j++) {
+                vbios_modeline_type2 * modeline = &res->modelines[j];
+                
+                if (modeline->x1 == xprev && modeline->y1 == yprev && timing) {
+                    set_timing_type2(modeline, timing);
+                }
+                else if (modeline->x1 == xprev && modeline->y1 == yprev) {
+                    modeline->x1 = modeline->x2 = x-1;
+                    modeline->y1 = modeline->y2 = y-1;
+
+                    gtf_timings(x, y, freqs[j], &modeline->clock,
+                            &modeline->hsyncstart, &modeline->hsyncend,
+                            &modeline->hblank, &modeline->vsyncstart,
+                            &modeline->vsyncend, &modeline->vblank);
+
+                    if (htotal)
+                        modeline->htotal = htotal;
+                    else
+                        modeline->htotal = modeline->hblank;
+
+                    if (vtotal)
+                        modeline->vtotal = vtotal;
+                    else
+                        modeline->vtotal = modeline->vblank;
+                }
+            }
+        }
+        break;
+    case BT_3:
+        {
+            vbios_resolution_type3 * res = map_type3_resolution(map, resolution);
+            
+            xprev = res->modelines[0].x1;
+            yprev = res->modelines[0].y1;
+
+            for (j=0; j < MODELINE_SLOTS; j++) {
+                vbios_modeline_type3 * modeline = &res->modelines[j];
+                
+                if (modeline->x1 == xprev && modeline->y1 == yprev && timing) {
+                    set_timing_type3(modeline, timing);
+                }
+                else if (modeline->x1 == xprev && modeline->y1 == yprev) {
+                    modeline->x1 = modeline->x2 = x-1;
+                    modeline->y1 = modeline->y2 = y-1;
+                    
+                    gtf_timings(x, y, freqs[j], &modeline->clock,
+                            &modeline->hsyncstart, &modeline->hsyncend,
+                            &modeline->hblank, &modeline->vsyncstart,
+                            &modeline->vsyncend, &modeline->vblank);
+                    if (htotal)
+                        modeline->htotal = htotal;
+                    else
+                        modeline->htotal = modeline->hblank;
+                    if (vtotal)
+                        modeline->vtotal = vtotal;
+                    else
+                        modeline->vtotal = modeline->vblank;
+
+                    modeline->timing_h   = y-1;
+                    modeline->timing_v   = x-1;
+                }
+            }
+        }
+        break;
+    case BT_UNKWN:
+        break;
+    }
+}
+
+void set_mode(vbios_map * map, cardinal mode, cardinal x, cardinal y, cardinal bp, cardinal htotal, cardinal vtotal, mode_timing * timing) {
+    cardinal i;
+
+    SCANNED(map->mode_table_size * sizeof(vbios_mode));
+
+    for (i=0; i < map->mode_table_size; i++) {
+        if (map->mode_table[i].mode == mode) {
+            if (bp && map->bios == BT_1) {
+                map->mode_table[i].bits_per_pixel = bp;
+            }
+
+            set_resolution(map, map->mode_table[i].resolution, x, y, htotal, vtotal, timing);
+            find_block(map, map->mode_table[i].resolution)->rewrite = TRUE;
+        }
     }
+}
 
-#if DEBUG
-    {
-        cardinal t = inl(0xcfc);
-        printf("relock PAM: (0x%08x)\n", t);
+/*
+ * Make every target resolution available at every depth, repurposing as few
+ * resolution blocks as possible.  Blocks already holding a target are kept;
+ * the others are given up largest first, blocks with no resolution before
+ * anything else.  All the blocks are then written in one pass.
+ */
+
+void rewrite_table(vbios_map * map, screen_size * targets, cardinal target_count, cardinal * depths, cardinal depth_count) {
+    cardinal i, j, k, score, best;
+    mode_block * block, * victim;
+    cardinal all_depths[MAX_TARGETS];
+
+    index_modes(map);
+
+    if (!depth_count) {
+        for (i=0; i < map->mode_table_size; i++) {
+            for (j=0; j < depth_count; j++) {
+                if (all_depths[j] == map->mode_table[i].bits_per_pixel) {
+                    break;
+                }
+            }
+            if (j == depth_count && depth_count < MAX_TARGETS) {
+                all_depths[depth_count++] = map->mode_table[i].bits_per_pixel;
+            }
+        }
+        depths = all_depths;
     }
-#endif
-}
 
+    for (i=0; i < map->block_count; i++) {
+        for (j=0; j < target_count; j++) {
+            if (map->blocks[i].x == targets[j].x && map->blocks[i].y == targets[j].y) {
+                map->blocks[i].keep = TRUE;
+            }
+        }
+    }
 
-void list_modes(vbios_map *map, cardinal raw) {
-    cardinal i, x, y;
+    for (i=0; i < target_count; i++) {
+        for (j=0; j < depth_count; j++) {
+            victim = NULL;
+            best = 0;
 
-    for (i=0; i < map->mode_table_size; i++) {
-        switch(map->bios) {
-        case BT_1:
-            {
-                vbios_resolution_type1 * res = map_type1_resolution(map, map->mode_table[i].resolution);
-                
-                x = ((((cardinal) res->x2) & 0xf0) << 4) | res->x1;
-                y = ((((cardinal) res->y2) & 0xf0) << 4) | res->y1;
-                
-                if (x != 0 && y != 0) {
-                    printf("Mode %02x : %dx%d, %d bits/pixel\n", map->mode_table[i].mode, x, y, map->mode_table[i].bits_per_pixel);
+            for (k=0; k < map->mode_table_size; k++) {
+                if (map->mode_table[k].bits_per_pixel != depths[j]) {
+                    continue;
                 }
 
-		if (raw)
-		{
-                    printf("Mode %02x (raw) :\n\t%02x %02x\n\t%02x\n\t%02x\n\t%02x\n\t%02x\n\t%02x\n\t%02x\n", map->mode_table[i].mode, res->unknow1[0],res->unknow1[1], res->x1,res->x_total,res->x2,res->y1,res->y_total,res->y2);
-		}
+                block = find_block(map, map->mode_table[k].resolution);
 
-            }
-            break;
-        case BT_2:
-            {
-                vbios_resolution_type2 * res = map_type2_resolution(map, map->mode_table[i].resolution);
-                
-                x = res->modelines[0].x1+1;
-                y = res->modelines[0].y1+1;
+                if (block->x == targets[i].x && block->y == targets[i].y) {
+                    break;
+                }
 
-                if (x != 0 && y != 0) {
-                    printf("Mode %02x : %dx%d, %d bits/pixel\n", map->mode_table[i].mode, x, y, map->mode_table[i].bits_per_pixel);
+                score = (block->x == 0 || block->y == 0) ? ~0U : block->x * block->y;
+
+                if (!block->keep && score >= best) {
+                    victim = block;
+                    best = score;
                 }
             }
-            break;
-        case BT_3:
-            {
-                vbios_resolution_type3 * res = map_type3_resolution(map, map->mode_table[i].resolution);
-                
-                x = res->modelines[0].x1+1;
-                y = res->modelines[0].y1+1;
-                
-                if (x != 0 && y != 0) {
-                    printf("Mode %02x : %dx%d, %d bits/pixel\n", map->mode_table[i].mode, x, y, map->mode_table[i].bits_per_pixel);
-                }
+
+            if (k < map->mode_table_size) {
+                continue;
             }
-            break;
-        case BT_UNKWN:
-            break;
+
+            if (!victim) {
+                fprintf(stderr, "No mode left at %d bits/pixel to hold %dx%d.\n",
+                        depths[j], targets[i].x, targets[i].y);
+                exit(2);
+            }
+
+            printf("Modes");
+            print_block_modes(map, victim);
+            printf(" : %dx%d becomes %dx%d\n", victim->x, victim->y, targets[i].x, targets[i].y);
+
+            victim->x = targets[i].x;
+            victim->y = targets[i].y;
+            victim->keep = victim->rewrite = TRUE;
+        }
+    }
+
+    for (i=0; i < map->block_count; i++) {
+        if (map->blocks[i].rewrite) {
+            set_resolution(map, map->blocks[i].resolution, map->blocks[i].x, map->blocks[i].y, 0, 0, NULL);
         }
     }
 }
 
-static void gtf_timings(int x, int y, int freq,
-        unsigned long *clock,
-        word *hsyncstart, word *hsyncend, word *hblank,
-        word *vsyncstart, word *vsyncend, word *vblank)
-{
-    int hbl, vbl, vfreq;
+/*
+ * Program one modeline slot of a mode, whatever it held before
+ */
 
-    vbl = y + (y+1)/(20000.0/(11*freq) - 1) + 1.5;
-    vfreq = vbl * freq;
-    hbl = 16 * (int)(x * (30.0 - 300000.0 / vfreq) /
-            (70.0 + 300000.0 / vfreq) / 16.0 + 0.5);
+void set_mode_slot(vbios_map * map, cardinal mode, cardinal slot, mode_timing * timing) {
+    cardinal i;
 
-    *vsyncstart = y;
-    *vsyncend = y + 3;
-    *vblank = vbl - 1;
-    *hsyncstart = x + hbl / 2 - (x + hbl + 50) / 100 * 8 - 1;
-    *hsyncend = x + hbl / 2 - 1;
-    *hblank = x + hbl - 1;
-    *clock = (x + hbl) * vfreq / 1000;
+    for (i=0; i < map->mode_table_size; i++) {
+        if (map->mode_table[i].mode == mode) {
+            switch(map->bios) {
+            case BT_2:
+                set_timing_type2(&map_type2_resolution(map, map->mode_table[i].resolution)->modelines[slot], timing);
+                break;
+            case BT_3:
+                set_timing_type3(&map_type3_resolution(map, map->mode_table[i].resolution)->modelines[slot], timing);
+                break;
+            case BT_1:
+            case BT_UNKWN:
+                fprintf(stderr, "%s BIOSes have no modelines to set.\n", bios_type_names[map->bios]);
+                exit(2);
+            }
+        }
+    }
 }
 
-void set_mode(vbios_map * map, cardinal mode, cardinal x, cardinal y, cardinal bp, cardinal htotal, cardinal vtotal) {
-    int xprev, yprev;
+/*
+ * Copy one modeline slot of a mode over all the others
+ */
+
+void clone_mode_slot(vbios_map * map, cardinal mode, cardinal slot) {
     cardinal i, j;
 
     for (i=0; i < map->mode_table_size; i++) {
         if (map->mode_table[i].mode == mode) {
             switch(map->bios) {
-            case BT_1:
-                {
-                    vbios_resolution_type1 * res = map_type1_resolution(map, map->mode_table[i].resolution);
-                    
-                    if (bp) {
-                        map->mode_table[i].bits_per_pixel = bp;
-                    }
-                    
-                    res->x2 = (htotal?(((htotal-x) >> 8) & 0x0f) : (res->x2 & 0x0f)) | ((x >> 4) & 0xf0);
-                    res->x1 = (x & 0xff);
-                    
-                    res->y2 = (vtotal?(((vtotal-y) >> 8) & 0x0f) : (res->y2 & 0x0f)) | ((y >> 4) & 0xf0);
-                    res->y1 = (y & 0xff);
-		    if (htotal)
-			res->x_total = ((htotal-x) & 0xff);
-
-		    if (vtotal)
-			res->y_total = ((vtotal-y) & 0xff);
-                }
-                break;
             case BT_2:
                 {
                     vbios_resolution_type2 * res = map_type2_resolution(map, map->mode_table[i].resolution);
 
-                    res->xchars = x / 8;
-                    res->ychars = y / 16 - 1;
-                    xprev = res->modelines[0].x1;
-                    yprev = res->modelines[0].y1;
-
-                    for(j=0; j < 3; j++) {
-                        vbios_modeline_type2 * modeline = &res->modelines[j];
-                        
-                        if (modeline->x1 == xprev && modeline->y1 == yprev) {
-                            modeline->x1 = modeline->x2 = x-1;
-                            modeline->y1 = modeline->y2 = y-1;
-
-                            gtf_timings(x, y, freqs[j], &modeline->clock,
-                                    &modeline->hsyncstart, &modeline->hsyncend,
-                                    &modeline->hblank, &modeline->vsyncstart,
-                                    &modeline->vsyncend, &modeline->vblank);
-
-                            if (htotal)
-                                modeline->htotal = htotal;
-                            else
-                                modeline->htotal = modeline->hblank;
-
-                            if (vtotal)
-                                modeline->vtotal = vtotal;
-                            else
-                                modeline->vtotal = modeline->vblank;
-                        }
+                    for (j=0; j < MODELINE_SLOTS; j++) {
+                        res->modelines[j] = res->modelines[slot];
                     }
                 }
                 break;
             case BT_3:
                 {
                     vbios_resolution_type3 * res = map_type3_resolution(map, map->mode_table[i].resolution);
-                    
-                    xprev = res->modelines[0].x1;
-                    yprev = res->modelines[0].y1;
-
-                    for (j=0; j < 3; j++) {
-                        vbios_modeline_type3 * modeline = &res->modelines[j];
-                        
-                        if (modeline->x1 == xprev && modeline->y1 == yprev) {
-                            modeline->x1 = modeline->x2 = x-1;
-                            modeline->y1 = modeline->y2 = y-1;
-                            
-                            gtf_timings(x, y, freqs[j], &modeline->clock,
-                                    &modeline->hsyncstart, &modeline->hsyncend,
-                                    &modeline->hblank, &modeline->vsyncstart,
-                                    &modeline->vsyncend, &modeline->vblank);
-                            if (htotal)
-                                modeline->htotal = htotal;
-                            else
-                                modeline->htotal = modeline->hblank;
-                            if (vtotal)
-                                modeline->vtotal = vtotal;
-                            else
-                                modeline->vtotal = modeline->vblank;
-
-                            modeline->timing_h   = y-1;
-                            modeline->timing_v   = x-1;
-                        }
+
+                    for (j=0; j < MODELINE_SLOTS; j++) {
+                        res->modelines[j] = res->modelines[slot];
                     }
                 }
                 break;
+            case BT_1:
             case BT_UNKWN:
-                break;
+                fprintf(stderr, "%s BIOSes have no modelines to clone.\n", bios_type_names[map->bios]);
+                exit(2);
             }
         }
     }
-}   
+}
 
 void display_map_info(vbios_map * map) {
     printf("Chipset: %s\n", chipset_type_names[map->chipset]);
@@ -742,182 +2311,505 @@ void display_map_info(vbios_map * map) {
 }
 
 
-int parse_args(int argc, char *argv[], char ** filename, chipset_type *forced_chipset, cardinal *list, cardinal *mode, cardinal *x, cardinal *y, cardinal *bp, cardinal *raw, cardinal *htotal, cardinal *vtotal) {
-    cardinal index = 1;
+typedef struct {
+    char * filename;
+    chipset_type forced_chipset;
+    cardinal list, raw;
 
-    *list = *mode = *x = *y = *raw = *htotal = *vtotal = 0;
+    cardinal mode, x, y, bp, htotal, vtotal;
 
-    *forced_chipset = CT_UNKWN;
-    
-    *filename = NULL;
+    char * plan_out;
+    char * plan_in;
+
+    char * edid;
+
+    boolean slot_set[MODELINE_SLOTS];
+    mode_timing slot_timing[MODELINE_SLOTS];
+    int clone_slot;
+
+    cardinal bandwidth, framebuffer;
+
+    char * config;
+    boolean simulate;
+
+    char * lock_dir;
+
+    boolean split;
+
+    screen_size targets[MAX_TARGETS];
+    cardinal target_count;
+    cardinal depths[MAX_TARGETS];
+    cardinal depth_count;
+} options;
+
+chipset_type parse_chipset(char * name) {
+    if (!strcmp(name, "845")) {
+        return CT_845G;
+    }
+    else if (!strcmp(name, "855")) {
+        return CT_855GM;
+    }
+    else if (!strcmp(name, "865")) {
+        return CT_865G;
+    }
+    else if (!strcmp(name, "915G")) {
+        return CT_915G;
+    }
+    else if (!strcmp(name, "915GM")) {
+        return CT_915GM;
+    }
+    else if (!strcmp(name, "945G")) {
+        return CT_945G;
+    }
+    else if (!strcmp(name, "945GM")) {
+        return CT_945GM;
+    }
+    else if (!strcmp(name, "946GZ")) {
+        return CT_946GZ;
+    }
+    else if (!strcmp(name, "G965")) {
+        return CT_G965;
+    }
+    else if (!strcmp(name, "Q965")) {
+        return CT_Q965;
+    }
+
+    return CT_UNKWN;
+}
+
+/*
+ * Parse "1280x800,1440x900" into sizes, or "16,32" into values when sizes
+ * is NULL.
+ */
 
-    if ((argc > index) && !strcmp(argv[index], "-f")) {
-        index++;
+int parse_list(char * arg, screen_size * sizes, cardinal * values, cardinal max) {
+    cardinal count = 0;
+    char * end;
 
-        if(argc<=index) {
-            return 0;
+    while (count < max) {
+        if (sizes) {
+            sizes[count].x = strtoul(arg, &end, 10);
+            if (*end != 'x' || end == arg) {
+                return -1;
+            }
+            arg = end + 1;
+            sizes[count].y = strtoul(arg, &end, 10);
         }
-        
-        *filename = argv[index];
-        
-        index++;
-        
-        if(argc<=index) {
-            return 0;
+        else {
+            values[count] = strtoul(arg, &end, 10);
         }
+
+        if (end == arg) {
+            return -1;
+        }
+
+        count++;
+
+        if (*end == '\0') {
+            return count;
+        }
+        if (*end != ',') {
+            return -1;
+        }
+        arg = end + 1;
     }
-    
-    if ((argc > index) && !strcmp(argv[index], "-c")) {
-        index++;
 
-        if(argc<=index) {
-            return 0;
+    return -1;
+}
+
+int parse_args(int argc, char *argv[], options * opts) {
+    cardinal index = 1;
+    boolean slots = FALSE;
+    cardinal i;
+
+    memset(opts, 0, sizeof(options));
+
+    opts->forced_chipset = CT_UNKWN;
+    opts->clone_slot = -1;
+
+    while ((argc > index) && argv[index][0] == '-') {
+        if (!strcmp(argv[index], "-l")) {
+            opts->list = 1;
+            index++;
+            continue;
         }
-        
-        if (!strcmp(argv[index], "845")) {
-            *forced_chipset = CT_845G;
+
+        if (!strcmp(argv[index], "-r")) {
+            opts->raw = 1;
+            index++;
+            continue;
+        }
+
+        if (!strcmp(argv[index], "-x")) {
+            opts->split = TRUE;
+            index++;
+            continue;
+        }
+
+        if (!strcmp(argv[index], "-S")) {
+            opts->simulate = TRUE;
+            index++;
+            continue;
+        }
+
+        /*
+         * The remaining options all take a value
+         */
+
+        if (argc <= index+1) {
+            return -1;
+        }
+
+        if (!strcmp(argv[index], "-f")) {
+            opts->filename = argv[index+1];
         }
-        else if (!strcmp(argv[index], "855")) {
-            *forced_chipset = CT_855GM;
+        else if (!strcmp(argv[index], "-c")) {
+            opts->forced_chipset = parse_chipset(argv[index+1]);
         }
-        else if (!strcmp(argv[index], "865")) {
-            *forced_chipset = CT_865G;
+        else if (!strcmp(argv[index], "-o")) {
+            opts->plan_out = argv[index+1];
         }
-        else if (!strcmp(argv[index], "915G")) {
-            *forced_chipset = CT_915G;
+        else if (!strcmp(argv[index], "-a")) {
+            opts->plan_in = argv[index+1];
         }
-        else if (!strcmp(argv[index], "915GM")) {
-            *forced_chipset = CT_915GM;
+        else if (!strcmp(argv[index], "-e")) {
+            opts->edid = argv[index+1];
         }
-        else if (!strcmp(argv[index], "945G")) {
-            *forced_chipset = CT_945G;
+        else if (!strcmp(argv[index], "-m")) {
+            cardinal slot, clock, hsyncstart, hsyncend, htotal, vsyncstart, vsyncend, vtotal;
+            cardinal hblank = 0, vblank = 0;
+            mode_timing * timing;
+            int fields;
+
+            fields = sscanf(argv[index+1], "%u:%u,%u,%u,%u,%u,%u,%u,%u,%u", &slot, &clock,
+                            &hsyncstart, &hsyncend, &htotal, &vsyncstart, &vsyncend, &vtotal,
+                            &hblank, &vblank);
+
+            if ((fields != 8 && fields != 10) || slot >= MODELINE_SLOTS ||
+                hblank > htotal || vblank > vtotal) {
+                return -1;
+            }
+
+            timing = &opts->slot_timing[slot];
+            timing->clock = clock;
+            timing->hsyncstart = hsyncstart;
+            timing->hsyncend = hsyncend;
+            timing->htotal = htotal;
+            timing->vsyncstart = vsyncstart;
+            timing->vsyncend = vsyncend;
+            timing->vtotal = vtotal;
+            timing->hblank = hblank;
+            timing->vblank = vblank;
+
+            opts->slot_set[slot] = TRUE;
+        }
+        else if (!strcmp(argv[index], "-t")) {
+            int count = parse_list(argv[index+1], opts->targets, NULL, MAX_TARGETS);
+            if (count < 0) {
+                return -1;
+            }
+            opts->target_count = count;
         }
-        else if (!strcmp(argv[index], "945GM")) {
-            *forced_chipset = CT_945GM;
+        else if (!strcmp(argv[index], "-d")) {
+            int count = parse_list(argv[index+1], NULL, opts->depths, MAX_TARGETS);
+            if (count < 0) {
+                return -1;
+            }
+            opts->depth_count = count;
+        }
+        else if (!strcmp(argv[index], "-L")) {
+            opts->lock_dir = argv[index+1];
         }
-        else if (!strcmp(argv[index], "946GZ")) {
-            *forced_chipset = CT_946GZ;
+        else if (!strcmp(argv[index], "-p")) {
+            opts->config = argv[index+1];
         }
-        else if (!strcmp(argv[index], "G965")) {
-            *forced_chipset = CT_G965;
+        else if (!strcmp(argv[index], "-b")) {
+            opts->bandwidth = (cardinal)atoi(argv[index+1]);
         }
-        else if (!strcmp(argv[index], "Q965")) {
-            *forced_chipset = CT_Q965;
+        else if (!strcmp(argv[index], "-s")) {
+            opts->framebuffer = (cardinal)atoi(argv[index+1]);
+        }
+        else if (!strcmp(argv[index], "-k")) {
+            opts->clone_slot = atoi(argv[index+1]);
+
+            if (opts->clone_slot < 0 || opts->clone_slot >= MODELINE_SLOTS) {
+                return -1;
+            }
         }
         else {
-            *forced_chipset = CT_UNKWN;
+            return -1;
         }
-        
-        index++;
-        
-        if (argc<=index) {
-            return 0;
+
+        index += 2;
+    }
+
+    /*
+     * -m and -k program the slots of the mode being set, from the command
+     * line or from -e
+     */
+
+    for (i=0; i < MODELINE_SLOTS; i++) {
+        slots |= opts->slot_set[i];
+    }
+
+    if ((slots || opts->clone_slot >= 0) &&
+        (opts->target_count || (argc <= index && !opts->edid))) {
+        return -1;
+    }
+
+    /*
+     * With -e, -d gives the depth of the mode to program
+     */
+
+    if (opts->edid && opts->depth_count) {
+        if (opts->depth_count > 1) {
+            return -1;
         }
+
+        opts->bp = opts->depths[0];
     }
 
-    if ((argc > index) && !strcmp(argv[index], "-l")) {
-        *list = 1;
-        index++;
+    /*
+     * Without a mode there must still be something to do
+     */
 
-        if(argc<=index) {
-            return 0;
+    if (argc <= index) {
+        if (!opts->list && !opts->plan_in && !opts->target_count && !opts->edid) {
+            return -1;
         }
+
+        return 0;
     }
-    
-    if ((argc > index) && !strcmp(argv[index], "-r")) {
-        *raw = 1;
-        index++;
 
-        if(argc<=index) {
-            return 0;
+    /*
+     * The resolution comes from the EDID, only mode and bits/pixel may be given
+     */
+
+    if (opts->edid) {
+        if (argc-index > 2) {
+            return -1;
+        }
+
+        opts->mode = (cardinal) strtol(argv[index], NULL, 16);
+
+        if (argc-index > 1) {
+            opts->bp = (cardinal)atoi(argv[index+1]);
         }
+
+        return 0;
     }
-    
+
     if (argc-index < 3 || argc-index > 6) {
         return -1;
     }
 
-    *mode = (cardinal) strtol(argv[index], NULL, 16);
-    *x = (cardinal)atoi(argv[index+1]);
-    *y = (cardinal)atoi(argv[index+2]);
-
+    opts->mode = (cardinal) strtol(argv[index], NULL, 16);
+    opts->x = (cardinal)atoi(argv[index+1]);
+    opts->y = (cardinal)atoi(argv[index+2]);
 
     if (argc-index > 3) {
-        *bp = (cardinal)atoi(argv[index+3]);
-    }
-    else {
-        *bp = 0;
+        opts->bp = (cardinal)atoi(argv[index+3]);
     }
     
     if (argc-index > 4) {
-        *htotal = (cardinal)atoi(argv[index+4]);
-    }
-    else {
-        *htotal = 0;
+        opts->htotal = (cardinal)atoi(argv[index+4]);
     }
 
     if (argc-index > 5) {
-        *vtotal = (cardinal)atoi(argv[index+5]);
-    }
-    else {
-        *vtotal = 0;
+        opts->vtotal = (cardinal)atoi(argv[index+5]);
     }
     
     return 0;
 }
 
 void usage(char *name) {
-    printf("Usage: %s [-f file] [-c chipset] [-l] [mode X Y] [bits/pixel] [htotal] [vtotal]\n", name);
+    printf("Usage: %s [-f file] [-c chipset] [-p config] [-S] [-L lockdir] [-l] [-o plan] [-x] [-m slot:timings] [-k slot] [-b MB/s] [-s kB] [mode X Y] [bits/pixel] [htotal] [vtotal]\n", name);
+    printf("       %s [-f file] [-c chipset] [-p config] [-S] [-L lockdir] [-l] [-o plan] [-x] -e edid [-d bpp] [mode] [bits/pixel]\n", name);
+    printf("       %s [-f file] [-c chipset] [-p config] [-S] [-L lockdir] [-l] [-o plan] -t XxY,... [-d bpp,...] [-b MB/s] [-s kB]\n", name);
+    printf("       %s [-f file] [-c chipset] [-p config] [-S] [-L lockdir] -a plan\n", name);
     printf("  Set the resolution to XxY for a video mode\n");
     printf("  Bits per pixel are optional.  htotal/vtotal settings are additionally optional.\n");
     printf("  Options:\n");
     printf("    -f use an alternate file (THIS IS USED FOR DEBUG PURPOSES)\n");
     printf("    -c force chipset type (THIS IS USED FOR DEBUG PURPOSES)\n");
+    printf("    -p use a file as the host bridge PCI configuration space (THIS IS USED FOR DEBUG PURPOSES)\n");
+    printf("    -L directory for the lock and the queue of pending patches (default %s,\n", LOCK_DIR);
+    printf("       none with -f)\n");
+    printf("    -S patch a simulated chipset whose BIOS is loaded from -f (THIS IS USED FOR DEBUG PURPOSES)\n");
     printf("    -l display the modes found in the video BIOS\n");
     printf("    -r display the modes found in the video BIOS in raw mode (THIS IS USED FOR DEBUG PURPOSES)\n");
+    printf("    -o write the patch to a plan file instead of applying it\n");
+    printf("    -a apply a plan file written by -o\n");
+    printf("    -e program the preferred timing of a binary EDID file, into the given mode\n");
+    printf("       or the largest one (of -d bits/pixel) when no mode is given\n");
+    printf("    -m slot:clock,hsyncstart,hsyncend,htotal,vsyncstart,vsyncend,vtotal[,hblank,vblank]\n");
+    printf("       program one modeline slot (0-2) of the mode with explicit timings, clock in kHz;\n");
+    printf("       blanking ends at the totals unless hblank and vblank are given\n");
+    printf("    -k clone a modeline slot (0-2) into all slots\n");
+    printf("    -x give the mode its own resolution block first, so modes sharing it do not change\n");
+    printf("    -t rewrite the mode table so that every listed resolution is available,\n");
+    printf("       giving up the largest modes first\n");
+    printf("    -d bits/pixel the -t resolutions are needed at (default: all), or of the -e mode\n");
+    printf("    -b scanout bandwidth budget in MB/s, slots over it fall back to a lower refresh rate\n");
+    printf("    -s framebuffer budget in kB (stolen memory), larger modes are refused\n");
+}
+
+void apply_plan_file(options * opts) {
+    patch_plan * plan = &arena.plan;
+    vbios_map * map;
+    cardinal hash;
+
+    read_patch(plan, opts->plan_in);
+
+    map = map_vbios(opts->filename, opts->forced_chipset);
+    hash = hash_image(map->image_ptr, plan->header.rom_size);
+
+    if (hash == plan->header.patched_hash) {
+        printf("Patch plan %s is already applied\n", opts->plan_in);
+    }
+    else if (hash != plan->header.image_hash) {
+        fprintf(stderr, "The BIOS does not match the image the patch plan %s was built from.\n", opts->plan_in);
+        close_vbios(map);
+        exit(2);
+    }
+    else {
+        commit_patch(map, plan, opts->lock_dir);
+
+        printf("Patch plan %s applied (%u records)\n", opts->plan_in, plan->header.count);
+    }
+
+    if (hal->report)
+        hal->report(map);
+
+    close_vbios(map);
 }
 
+#ifndef PERF_CHECK
+
 int main (int argc, char *argv[]) {
     vbios_map * map;
-    cardinal list, mode, x, y, bp, raw, htotal, vtotal;
-    char * filename;
-    chipset_type forced_chipset;
+    patch_plan * plan;
+    mode_timing timing;
+    options opts;
+    cardinal i;
     
     printf("Intel 800/900 Series VBIOS Hack : version %s\n\n", VERSION);
 
-    if (parse_args(argc, argv, &filename, &forced_chipset, &list, &mode, &x, &y, &bp, &raw, &htotal, &vtotal) == -1) {
+    if (parse_args(argc, argv, &opts) == -1) {
         usage(argv[0]);
         return 2;
     }
 
-    initialize_system(filename);
+    /* a BIOS file only shares a queue when one is given with -L */
+    if (!opts.lock_dir && !opts.filename) {
+        opts.lock_dir = LOCK_DIR;
+    }
+
+    if (opts.plan_in) {
+        initialize_system(opts.filename, opts.config, opts.simulate);
+        apply_plan_file(&opts);
+        return 0;
+    }
+
+    initialize_system(opts.filename, opts.config, opts.simulate);
     
-    map = open_vbios(filename, forced_chipset);
+    map = open_vbios(opts.filename, opts.forced_chipset);
     display_map_info(map);
 
     printf("\n");
 
-    if (list) {
-        list_modes(map, raw);
+    if (opts.list) {
+        list_modes(map, opts.raw, opts.bandwidth || opts.framebuffer);
+    }
+
+    if (opts.edid) {
+        read_edid_timing(opts.edid, &timing);
+
+        opts.x = timing.x;
+        opts.y = timing.y;
+
+        if (!opts.mode) {
+            opts.mode = pick_mode(map, opts.x, opts.y, opts.bp);
+
+            if (!opts.mode) {
+                fprintf(stderr, "There is no %d bits/pixel mode to program the EDID timing into.\n", opts.bp);
+                close_vbios(map);
+                exit(2);
+            }
+        }
+
+        printf("EDID preferred timing: %dx%d, %lu kHz, htotal %d, vtotal %d\n",
+               timing.x, timing.y, timing.clock, timing.htotal, timing.vtotal);
+    }
+
+    if (!opts.target_count && opts.mode && !has_mode(map, opts.mode)) {
+        fprintf(stderr, "Mode %02x is not in the mode table.\n", opts.mode);
+        close_vbios(map);
+        exit(2);
     }
 
-    if (mode!=0 && x!=0 && y!=0) {
-        if (!filename) 
-            unlock_vbios(map);
+    if (opts.target_count || (opts.mode!=0 && opts.x!=0 && opts.y!=0)) {
+        plan = &arena.plan;
+
+        stage_vbios(map);
+
+        if (opts.target_count) {
+            rewrite_table(map, opts.targets, opts.target_count, opts.depths, opts.depth_count);
+        }
+        else {
+            if (opts.split) {
+                split_mode(map, opts.mode);
+            }
+
+            set_mode(map, opts.mode, opts.x, opts.y, opts.bp, opts.htotal, opts.vtotal, opts.edid ? &timing : NULL);
+
+            for (i=0; i < MODELINE_SLOTS; i++) {
+                if (opts.slot_set[i]) {
+                    opts.slot_timing[i].x = opts.x;
+                    opts.slot_timing[i].y = opts.y;
 
-        set_mode(map, mode, x, y, bp, htotal, vtotal);
+                    set_mode_slot(map, opts.mode, i, &opts.slot_timing[i]);
+                }
+            }
+
+            if (opts.clone_slot >= 0) {
+                clone_mode_slot(map, opts.mode, opts.clone_slot);
+            }
+
+        }
+
+        if (opts.bandwidth || opts.framebuffer) {
+            check_budget(map, opts.bandwidth, opts.framebuffer);
+        }
 
-        if (!filename)
-            relock_vbios(map);
+        build_patch(map, plan);
+
+        if (opts.plan_out) {
+            write_patch(plan, opts.plan_out);
+
+            printf("Patch plan written to %s (%u records, %u bytes)\n",
+                   opts.plan_out, plan->header.count, plan->data_size);
+        }
+        else {
+            commit_patch(map, plan, opts.lock_dir);
         
-        printf("Patch mode %02x to resolution %dx%d complete\n", mode, x, y);
+            if (opts.target_count)
+                printf("Rewrite of the mode table complete\n");
+            else
+                printf("Patch mode %02x to resolution %dx%d complete\n", opts.mode, opts.x, opts.y);
+        }
         
-        if (list) {
-            list_modes(map, raw);
+        if (opts.list) {
+            list_modes(map, opts.raw, opts.bandwidth || opts.framebuffer);
         }
     }
 
+    if (hal->report)
+        hal->report(map);
+
     close_vbios(map);
     
     return 0;
 }
+
+#endif
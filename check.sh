@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# Runs the unlock, patch, relock and verify cycle on the simulated chipset
+# for a TYPE 1, 2 and 3 image of the perf_check corpus, directly and through
+# the patch queue, and checks the patched modes and the simulator counters.
+# Then patchers of different modes run at once on one image file, sharing
+# the queue and a configuration space file, as boot and resume hooks do.
+#
+
+dir=`mktemp -d` || exit 2
+trap 'rm -rf "$dir"' EXIT
+./perf_check -g "$dir" || exit 2
+
+failed=0
+
+# check image type bytes output expected...
+check()
+{
+    image=$1 type=$2 bytes=$3
+    shift 3
+    for expected in "BIOS: TYPE $type" "$@" \
+        "Simulator: 2 config reads, 2 config writes, $bytes BIOS bytes written, 0 dropped, PAM 11 11"
+    do
+        if ! grep -qF "$expected" "$dir/out"; then
+            echo "image.$image: missing \"$expected\""
+            failed=1
+        fi
+    done
+}
+
+# image, BIOS type, bytes written by 3c, by 38 moved to its own block
+set -- 0 1 6 6  4 2 83 85  8 3 93 95
+while [ $# -gt 0 ]; do
+    ./915resolution -S -f "$dir/image.$1" -l 3c 1400 1050 > "$dir/out" 2>&1
+    check $1 $2 $3 "Mode 3c : 1400x1050, 8 bits/pixel" \
+        "Mode 4d : 1400x1050, 16 bits/pixel" \
+        "Patch mode 3c to resolution 1400x1050 complete"
+
+    ./915resolution -S -f "$dir/image.$1" -L "$dir/q" -x -l 38 1280 800 \
+        > "$dir/out" 2>&1
+    check $1 $2 $4 "Mode 38 : 1280x800, 8 bits/pixel" \
+        "Mode 49 : 1280x1024, 16 bits/pixel" \
+        "Patch mode 38 to resolution 1280x800 complete"
+    if [ -n "`ls -A "$dir/q" | grep -v '^lock$'`" ]; then
+        echo "image.$1: patches left in the queue"
+        failed=1
+    fi
+    shift 4
+done
+
+# a 915GM host bridge, shadow enabled for reads only
+config()
+{
+    printf '\206\200\220\045'
+    dd if=/dev/zero bs=1 count=140 2> /dev/null
+    printf '\021\021\021\021\021\021\021'
+    dd if=/dev/zero bs=1 count=105 2> /dev/null
+}
+
+for image in 0 4 8; do
+    config > "$dir/config"
+    rm -rf "$dir/q"
+
+    pids=
+    for patch in 30:800x480 32:1024x600 34:1152x864 38:1280x800 \
+                 3a:1440x900 3c:1680x1050; do
+        mode=${patch%:*} size=${patch#*:}
+        ./915resolution -f "$dir/image.$image" -p "$dir/config" -L "$dir/q" \
+            $mode ${size%x*} ${size#*x} > "$dir/out.$mode" 2>&1 &
+        pids="$pids $!"
+    done
+    for pid in $pids; do
+        if ! wait $pid; then
+            echo "image.$image: a parallel patcher failed:"
+            cat "$dir"/out.*
+            failed=1
+        fi
+    done
+
+    ./915resolution -f "$dir/image.$image" -l > "$dir/out"
+    for expected in "30 : 800x480" "32 : 1024x600" "34 : 1152x864" \
+                    "38 : 1280x800" "3a : 1440x900" "3c : 1680x1050" \
+                    "41 : 800x480" "4d : 1680x1050" "50 : 800x480" \
+                    "5c : 1680x1050"; do
+        if ! grep -qF "Mode $expected," "$dir/out"; then
+            echo "image.$image: parallel patchers, missing \"Mode $expected\""
+            failed=1
+        fi
+    done
+
+    pam=`od -An -tx1 -j144 -N7 "$dir/config" | tr -d ' '`
+    if [ "$pam" != 11111111111111 ]; then
+        echo "image.$image: parallel patchers left PAM $pam"
+        failed=1
+    fi
+    if [ -n "`ls -A "$dir/q" | grep -v '^lock$'`" ]; then
+        echo "image.$image: patches left in the parallel queue"
+        failed=1
+    fi
+done
+
+[ $failed = 0 ] && echo "make check: ok" || echo "make check: FAILED"
+exit $failed
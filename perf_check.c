@@ -0,0 +1,495 @@
+/* Copyright (C) 2022 Nathan Somers
+ *
+ * This file is part of 915resolution.
+ *
+ * 915resolution is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ * 915resolution is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with 915resolution. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Regression benchmark, run by make perf-check.
+ *
+ * A synthetic corpus of video bios images goes through the same stages as
+ * 915resolution on the simulated chipset: open, locate the mode table,
+ * detect the bios type, list, patch and verify.  The time per image of
+ * every stage is compared against a baseline file, and a stage slower
+ * than the baseline by more than the threshold fails the check.  The
+ * baseline is only written with -u; without a baseline for this version
+ * the check fails.
+ */
+
+#define PERF_CHECK
+#include "915resolution.c"
+
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define BASELINE_VERSION    1
+#define DEFAULT_THRESHOLD   25
+#define NOISE_FLOOR         100     /* ns, ignored for tiny stages */
+
+#define CORPUS_ROUNDS       50
+
+typedef enum {
+    PH_OPEN, PH_LOCATE, PH_DETECT, PH_LIST, PH_PATCH, PH_VERIFY, PH_COUNT
+} phase;
+
+char * phase_names[] = { "open", "locate", "detect", "list", "patch", "verify" };
+
+bios_type corpus_types[] = { BT_1, BT_2, BT_3 };
+cardinal corpus_tables[] = { 0x269, 0x1800, 0x3400, 0x7000 };
+
+#define CORPUS_SIZE \
+    ((sizeof(corpus_types) / sizeof(corpus_types[0])) * (sizeof(corpus_tables) / sizeof(corpus_tables[0])))
+
+typedef struct {
+    unsigned long long ns[PH_COUNT];
+    unsigned long long scanned[PH_COUNT];
+    unsigned long long cycles;
+} perf_result;
+
+
+/*
+ * Build an image the way the Intel bios lays it out: six resolution blocks
+ * shared by the 8, 16 and 32 bits/pixel modes, and the mode table at the
+ * given offset.  The blocks are filled in by set_resolution itself.
+ */
+
+void make_image(byte * image, bios_type type, cardinal table) {
+    screen_size sizes[] = { {640, 480}, {800, 600}, {1024, 768}, {1280, 1024}, {1600, 1200}, {1920, 1440} };
+    byte first[] = { 0x30, 0x41, 0x50 };
+    byte step[] = { 0, 2, 4, 8, 10, 12 };
+    vbios_map * map = &arena.map;
+    vbios_mode * mode;
+    cardinal i, j, size;
+
+    switch (type) {
+    case BT_1:
+        size = 6 + sizeof(vbios_resolution_type1);
+        break;
+    case BT_2:
+        size = sizeof(vbios_resolution_type2) + MODELINE_SLOTS * sizeof(vbios_modeline_type2);
+        break;
+    default:
+        size = sizeof(vbios_resolution_type3) + MODELINE_SLOTS * sizeof(vbios_modeline_type3);
+        break;
+    }
+
+    memset(image, 0, VBIOS_SIZE);
+    image[0] = 0x55;
+    image[1] = 0xaa;
+    image[2] = VBIOS_SIZE / 512;
+    memcpy(image + 0x100, INTEL_SIGNATURE, strlen(INTEL_SIGNATURE));
+
+    memset(map, 0, sizeof(vbios_map));
+    map->bios_ptr = image;
+    map->bios = type;
+
+    mode = (vbios_mode *) (image + table);
+
+    for (i=0; i < 6; i++) {
+        set_resolution(map, 0x1000 + i * size, sizes[i].x, sizes[i].y,
+                       sizes[i].x + 160, sizes[i].y + 45, NULL);
+
+        for (j=0; j < 3; j++) {
+            mode[j*6 + i].mode = first[j] + step[i];
+            mode[j*6 + i].bits_per_pixel = 8 << j;
+            mode[j*6 + i].resolution = 0x1000 + i * size;
+        }
+    }
+
+    mode[18].mode = 0xff;
+}
+
+void write_corpus(char * dir) {
+    static byte image[VBIOS_SIZE];
+    char path[PATH_MAX];
+    cardinal i, n;
+    int fd;
+
+    n = 0;
+    for (i=0; i < sizeof(corpus_types) / sizeof(corpus_types[0]); i++) {
+        cardinal j;
+
+        for (j=0; j < sizeof(corpus_tables) / sizeof(corpus_tables[0]); j++, n++) {
+            make_image(image, corpus_types[i], corpus_tables[j]);
+
+            snprintf(path, sizeof(path), "%s/image.%u", dir, n);
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0 || write(fd, image, VBIOS_SIZE) != VBIOS_SIZE) {
+                perror("Unable to write the corpus");
+                exit(2);
+            }
+            close(fd);
+        }
+    }
+}
+
+void remove_corpus(char * dir) {
+    char path[PATH_MAX];
+    cardinal i;
+
+    for (i=0; i < CORPUS_SIZE; i++) {
+        snprintf(path, sizeof(path), "%s/image.%u", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+
+unsigned long long now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * A user space cycle counter, or -1 where perf events are not available
+ */
+
+int open_cycle_counter(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+unsigned long long read_cycles(int fd) {
+    unsigned long long count = 0;
+
+    if (fd >= 0 && read(fd, &count, sizeof(count)) != sizeof(count)) {
+        count = 0;
+    }
+
+    return count;
+}
+
+/*
+ * Run one image through every stage, adding the time of each to result
+ */
+
+void run_image(char * filename, bios_type type, int null_fd, int cycle_fd, perf_result * result) {
+    unsigned long long t[PH_COUNT + 1], b[PH_COUNT + 1];
+    unsigned long long cycles;
+    vbios_map * map;
+    patch_plan * plan = &arena.plan;
+    int saved;
+    cardinal i;
+
+    sim_init(NULL);
+
+    cycles = read_cycles(cycle_fd);
+
+    t[PH_OPEN] = now();
+    b[PH_OPEN] = bytes_scanned;
+    map = map_vbios(filename, CT_UNKWN);
+
+    t[PH_LOCATE] = now();
+    b[PH_LOCATE] = bytes_scanned;
+    locate_mode_table(map);
+
+    t[PH_DETECT] = now();
+    b[PH_DETECT] = bytes_scanned;
+    detect_bios(map);
+    index_modes(map);
+
+    if (map->bios != type || map->block_count != 6) {
+        fprintf(stderr, "%s: detected as %s with %u resolution blocks, expected %s with 6.\n",
+                filename, bios_type_names[map->bios], map->block_count, bios_type_names[type]);
+        exit(2);
+    }
+
+    fflush(stdout);
+    saved = dup(1);
+    dup2(null_fd, 1);
+
+    t[PH_LIST] = now();
+    b[PH_LIST] = bytes_scanned;
+    list_modes(map, TRUE, TRUE);
+    fflush(stdout);
+
+    t[PH_PATCH] = now();
+    b[PH_PATCH] = bytes_scanned;
+    stage_vbios(map);
+    set_mode(map, 0x3c, 1400, 1050, 0, 0, 0, NULL);
+    build_patch(map, plan);
+
+    t[PH_VERIFY] = now();
+    b[PH_VERIFY] = bytes_scanned;
+    commit_patch(map, plan, NULL);
+
+    t[PH_COUNT] = now();
+    b[PH_COUNT] = bytes_scanned;
+
+    result->cycles += read_cycles(cycle_fd) - cycles;
+
+    dup2(saved, 1);
+    close(saved);
+
+    for (i=0; i < PH_COUNT; i++) {
+        result->ns[i] += t[i+1] - t[i];
+        result->scanned[i] += b[i+1] - b[i];
+    }
+
+    close_vbios(map);
+}
+
+/*
+ * Run the corpus a number of times and keep, for every image and stage, the
+ * fastest run, which is the one least disturbed by the rest of the system.
+ */
+
+void run_corpus(char * dir, perf_result * best, boolean * have_cycles) {
+    static perf_result fastest[CORPUS_SIZE];
+    char path[PATH_MAX];
+    perf_result run;
+    int null_fd, cycle_fd;
+    cardinal r, i, j;
+
+    null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0) {
+        perror("Unable to open /dev/null");
+        exit(2);
+    }
+
+    cycle_fd = open_cycle_counter();
+    *have_cycles = cycle_fd >= 0;
+
+    hal = &sim_hal;
+
+    for (r=0; r <= CORPUS_ROUNDS; r++) {
+        for (i=0; i < CORPUS_SIZE; i++) {
+            memset(&run, 0, sizeof(run));
+
+            snprintf(path, sizeof(path), "%s/image.%u", dir, i);
+            run_image(path, corpus_types[i / (CORPUS_SIZE / (sizeof(corpus_types) / sizeof(corpus_types[0])))],
+                      null_fd, cycle_fd, &run);
+
+            /* the first round only warms up the caches */
+            if (r == 0) {
+                continue;
+            }
+
+            if (r == 1 || run.cycles < fastest[i].cycles) {
+                fastest[i].cycles = run.cycles;
+            }
+
+            for (j=0; j < PH_COUNT; j++) {
+                if (r == 1 || run.ns[j] < fastest[i].ns[j]) {
+                    fastest[i].ns[j] = run.ns[j];
+                }
+
+                fastest[i].scanned[j] = run.scanned[j];
+            }
+        }
+    }
+
+    memset(best, 0, sizeof(*best));
+
+    for (i=0; i < CORPUS_SIZE; i++) {
+        for (j=0; j < PH_COUNT; j++) {
+            best->ns[j] += fastest[i].ns[j];
+            best->scanned[j] += fastest[i].scanned[j];
+        }
+        best->cycles += fastest[i].cycles;
+    }
+
+    for (j=0; j < PH_COUNT; j++) {
+        best->ns[j] /= CORPUS_SIZE;
+        best->scanned[j] /= CORPUS_SIZE;
+    }
+    best->cycles /= CORPUS_SIZE;
+
+    if (cycle_fd >= 0) {
+        close(cycle_fd);
+    }
+    close(null_fd);
+}
+
+
+/*
+ * The baseline is a text file: a version line, then one line per stage
+ * with its time per image in ns.  A baseline of another format, or of
+ * another version of 915resolution, does not count.
+ */
+
+boolean read_baseline(char * filename, perf_result * base) {
+    char name[32], version[32];
+    unsigned long long value;
+    int format;
+    cardinal i;
+    FILE * f;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        return FALSE;
+    }
+
+    memset(base, 0, sizeof(*base));
+
+    if (fscanf(f, "915resolution-perf %d %31s\n", &format, version) != 2 ||
+        format != BASELINE_VERSION || strcmp(version, VERSION)) {
+        fclose(f);
+        return FALSE;
+    }
+
+    while (fscanf(f, "%31s %llu\n", name, &value) == 2) {
+        for (i=0; i < PH_COUNT; i++) {
+            if (!strcmp(name, phase_names[i])) {
+                base->ns[i] = value;
+            }
+        }
+
+        if (!strcmp(name, "cycles")) {
+            base->cycles = value;
+        }
+    }
+
+    fclose(f);
+    return TRUE;
+}
+
+void write_baseline(char * filename, perf_result * result) {
+    cardinal i;
+    FILE * f;
+
+    f = fopen(filename, "w");
+    if (!f) {
+        perror("Unable to write the baseline");
+        exit(2);
+    }
+
+    fprintf(f, "915resolution-perf %d %s\n", BASELINE_VERSION, VERSION);
+
+    for (i=0; i < PH_COUNT; i++) {
+        fprintf(f, "%s %llu\n", phase_names[i], result->ns[i]);
+    }
+
+    if (result->cycles) {
+        fprintf(f, "cycles %llu\n", result->cycles);
+    }
+
+    fclose(f);
+}
+
+void print_change(unsigned long long value, unsigned long long base) {
+    if (base) {
+        printf(" %10llu %+7.1f%%", base, 100.0 * ((double) value - base) / base);
+    }
+    printf("\n");
+}
+
+
+void perf_usage(char * name) {
+    fprintf(stderr, "Usage: %s [-u] baseline [threshold %%]\n", name);
+    fprintf(stderr, "       %s -g directory\n", name);
+    fprintf(stderr, "  -u record the baseline, the check fails without one\n");
+    fprintf(stderr, "  -g only write the corpus to directory, as image.0 to image.%u\n", (cardinal) CORPUS_SIZE - 1);
+    fprintf(stderr, "  Fails when a stage is more than threshold %% (default %d) slower than the baseline.\n",
+            DEFAULT_THRESHOLD);
+}
+
+int main(int argc, char *argv[]) {
+    char dir[] = "/tmp/915resolution-perf.XXXXXX";
+    perf_result result, base;
+    boolean update = FALSE, have_base, have_cycles;
+    cardinal threshold = DEFAULT_THRESHOLD;
+    cardinal regressions = 0;
+    unsigned long long total = 0, total_scanned = 0;
+    cardinal i;
+    int arg = 1;
+
+    /* make check runs the tool itself on the corpus */
+    if (argc == 3 && !strcmp(argv[1], "-g")) {
+        write_corpus(argv[2]);
+        return 0;
+    }
+
+    if (arg < argc && !strcmp(argv[arg], "-u")) {
+        update = TRUE;
+        arg++;
+    }
+
+    if (arg >= argc || argc - arg > 2) {
+        perf_usage(argv[0]);
+        return 2;
+    }
+
+    if (argc - arg == 2) {
+        threshold = atoi(argv[arg+1]);
+    }
+
+    if (!mkdtemp(dir)) {
+        perror("Unable to create the corpus directory");
+        return 2;
+    }
+
+    write_corpus(dir);
+
+    run_corpus(dir, &result, &have_cycles);
+
+    remove_corpus(dir);
+
+    have_base = !update && read_baseline(argv[arg], &base);
+    if (!have_base) {
+        memset(&base, 0, sizeof(base));
+    }
+
+    printf("%u images, fastest of %u runs each\n\n", (cardinal) CORPUS_SIZE, CORPUS_ROUNDS);
+    printf("%-8s %10s %12s %10s %8s\n", "stage", "ns/image", "bytes/image", "baseline", "change");
+
+    for (i=0; i < PH_COUNT; i++) {
+        printf("%-8s %10llu %12llu", phase_names[i], result.ns[i], result.scanned[i]);
+        print_change(result.ns[i], base.ns[i]);
+
+        total += result.ns[i];
+        total_scanned += result.scanned[i];
+
+        if (have_base && result.ns[i] > base.ns[i] + NOISE_FLOOR &&
+            result.ns[i] * 100 > base.ns[i] * (100 + threshold)) {
+            regressions++;
+        }
+    }
+
+    printf("%-8s %10llu %12llu\n\n", "total", total, total_scanned);
+
+    if (have_cycles) {
+        printf("cycles/image: %llu", result.cycles);
+        print_change(result.cycles, base.cycles);
+    }
+    else {
+        printf("cycles/image: not available (perf events)\n");
+    }
+
+    printf("\n");
+
+    if (update) {
+        write_baseline(argv[arg], &result);
+        printf("Baseline recorded in %s\n", argv[arg]);
+        return 0;
+    }
+
+    if (!have_base) {
+        fprintf(stderr, "No baseline for version %s in %s, record one with -u.\n", VERSION, argv[arg]);
+        return 2;
+    }
+
+    if (regressions) {
+        printf("%u stage(s) more than %u%% slower than the baseline\n", regressions, threshold);
+        return 1;
+    }
+
+    printf("No stage more than %u%% slower than the baseline\n", threshold);
+    return 0;
+}